@@ -0,0 +1,166 @@
+/*
+ * client_bench.c - lookup latency of the client registry: list vs rhashtable
+ *
+ * For 10, 100, 1000 ... max_clients clients the module builds both the old
+ * RCU list and the rhashtable that replaced it, then looks up random
+ * existing ids under rcu_read_lock() and prints the mean ns per lookup.
+ * The list walk is O(n), so it does fewer lookups at large counts.
+ *
+ * insmod client_bench.ko [max_clients=1000000] [lookups=100000]
+ * insmod blocks until the largest table is measured (about 50 MB of clients
+ * at 1000000) and frees everything before it returns. The results are in
+ * dmesg; rmmod client_bench before the next run.
+ */
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/rculist.h>
+#include <linux/rcupdate.h>
+#include <linux/rhashtable.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include <linux/types.h>
+#include <linux/printk.h>
+
+MODULE_LICENSE("GPL");
+
+static int max_clients = 1000000;
+module_param(max_clients, int, 0444);
+MODULE_PARM_DESC(max_clients, "Largest number of clients (10 to 1000000)");
+
+static int lookups = 100000;
+module_param(lookups, int, 0444);
+MODULE_PARM_DESC(lookups, "Lookups per measurement");
+
+/* Limit for the list: about this many list nodes visited per measurement */
+#define LIST_BUDGET 200000000ULL
+
+/* Same lookup fields as struct client, one object sits on both structures */
+struct bench_client {
+    int id;
+    struct list_head list;
+    struct rhash_head node;
+    u64 packets;
+    u64 bytes;
+};
+
+static const struct rhashtable_params bench_ht_params = {
+    .key_len             = sizeof(int),
+    .key_offset          = offsetof(struct bench_client, id),
+    .head_offset         = offsetof(struct bench_client, node),
+    .automatic_shrinking = true,
+};
+
+static LIST_HEAD(bench_list);
+static struct rhashtable bench_ht;
+static struct bench_client *clients;
+static int *keys;               /* ids to look up, in random order */
+
+static struct bench_client *list_lookup(int id)
+{
+    struct bench_client *c;
+
+    list_for_each_entry_rcu(c, &bench_list, list)
+        if (c->id == id)
+            return c;
+    return NULL;
+}
+
+static struct bench_client *ht_lookup(int id)
+{
+    return rhashtable_lookup(&bench_ht, &id, bench_ht_params);
+}
+
+/* Mean ns of n lookups with one of the two functions, 0 if one failed */
+static u64 bench_lookups(struct bench_client *(*lookup)(int), int n)
+{
+    u64 start, elapsed;
+    int i, found = 0;
+
+    start = ktime_get_ns();
+    for (i = 0; i < n; i++) {
+        rcu_read_lock();
+        found += lookup(keys[i]) != NULL;
+        rcu_read_unlock();
+
+        /* a long list walk must not hog the CPU */
+        if ((i & 63) == 0)
+            cond_resched();
+    }
+    elapsed = ktime_get_ns() - start;
+
+    return found == n ? div_u64(elapsed, n) : 0;
+}
+
+/* Build both structures with nr clients and time them */
+static int bench_one(int nr)
+{
+    int i, ret, n_list;
+
+    ret = rhashtable_init(&bench_ht, &bench_ht_params);
+    if (ret)
+        return ret;
+
+    for (i = 0; i < nr; i++) {
+        /* spread the ids (still unique: 7919 is odd) so they are not a simple counter */
+        clients[i].id = (int)(i * 7919u + 1);
+        list_add_tail_rcu(&clients[i].list, &bench_list);
+        /* -EBUSY: the table is growing in the background, try again */
+        while ((ret = rhashtable_insert_fast(&bench_ht, &clients[i].node,
+                                             bench_ht_params)) == -EBUSY)
+            cond_resched();
+        if (ret)
+            goto out;
+        if ((i & 1023) == 0)
+            cond_resched();
+    }
+
+    for (i = 0; i < lookups; i++)
+        keys[i] = clients[prandom_u32() % nr].id;
+
+    /* a list lookup visits nr / 2 nodes on average */
+    n_list = clamp_t(u64, div_u64(LIST_BUDGET, nr), 100, lookups);
+
+    pr_info("client_bench: %8d clients %10llu ns list (%d lookups) %10llu ns hash (%d lookups)\n",
+            nr, bench_lookups(list_lookup, n_list), n_list,
+            bench_lookups(ht_lookup, lookups), lookups);
+
+out:
+    INIT_LIST_HEAD(&bench_list);
+    rhashtable_destroy(&bench_ht);
+    return ret;
+}
+
+static int __init client_bench_init(void)
+{
+    int nr, ret = 0;
+
+    if (max_clients < 10 || max_clients > 1000000 || lookups < 100)
+        return -EINVAL;
+
+    clients = kvcalloc(max_clients, sizeof(*clients), GFP_KERNEL);
+    keys = kvcalloc(lookups, sizeof(*keys), GFP_KERNEL);
+    if (!clients || !keys) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    for (nr = 10; nr <= max_clients && !ret; nr *= 10)
+        ret = bench_one(nr);
+    if (!ret && nr / 10 != max_clients)
+        ret = bench_one(max_clients);
+
+out:
+    kvfree(keys);
+    kvfree(clients);
+    return ret;
+}
+
+static void __exit client_bench_exit(void)
+{
+}
+
+module_init(client_bench_init);
+module_exit(client_bench_exit);
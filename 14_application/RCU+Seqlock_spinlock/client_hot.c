@@ -0,0 +1,246 @@
+/*
+ * client_hot.c - one hot client updated from every CPU: seqlock vs per-CPU shards
+ *
+ *   seqlock - packets/bytes next to the lookup fields behind one seqlock_t
+ *             (struct client before this change)
+ *   percpu  - lookup fields alone on their cache line, counters in per-CPU
+ *             shards summed on read (struct client now)
+ *
+ * One kthread per online CPU calls the update for duration_ms while insmod
+ * itself keeps reading the totals. Updates/s, reads/s and the read retries
+ * caused by writers are printed with pr_info.
+ *
+ * insmod client_hot.ko [duration_ms=1000]
+ * insmod blocks for the two runs (2 * duration_ms) and stops every updater
+ * with kthread_stop() before it returns. The table is in dmesg.
+ */
+#include <linux/module.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/types.h>
+#include <linux/printk.h>
+
+MODULE_LICENSE("GPL");
+
+static int duration_ms = 1000;
+module_param(duration_ms, int, 0444);
+MODULE_PARM_DESC(duration_ms, "Length of every run in ms");
+
+/* The old struct client */
+struct hot_seq_client {
+    int id;
+    seqlock_t seq;
+    u64 packets;
+    u64 bytes;
+};
+
+/* Same layout as struct client_stats / struct client */
+struct hot_stats {
+    u64 packets;
+    u64 bytes;
+    struct u64_stats_sync syncp;
+};
+
+struct hot_pcpu_client {
+    int id;
+    struct hot_stats __percpu *stats;
+} ____cacheline_aligned_in_smp;
+
+static struct hot_seq_client seq_client;
+static struct hot_pcpu_client pcpu_client;
+
+enum hot_design { HOT_SEQLOCK, HOT_PERCPU };
+static const char * const design_names[] = { "seqlock", "percpu" };
+
+struct hot_thread {
+    struct task_struct *task;
+    enum hot_design design;
+    u64 ops;
+};
+
+static struct hot_thread *threads;
+static unsigned long deadline;          /* jiffies at which the updaters stop */
+
+/* ---- one update of 1 packet, 1500 bytes, as update_client_stats() does ---- */
+static void hot_update(enum hot_design design)
+{
+    struct hot_stats *s;
+    unsigned long flags;
+
+    if (design == HOT_SEQLOCK) {
+        write_seqlock(&seq_client.seq);
+        seq_client.packets += 1;
+        seq_client.bytes   += 1500;
+        write_sequnlock(&seq_client.seq);
+        return;
+    }
+
+    s = get_cpu_ptr(pcpu_client.stats);
+    flags = u64_stats_update_begin_irqsave(&s->syncp);
+    s->packets += 1;
+    s->bytes   += 1500;
+    u64_stats_update_end_irqrestore(&s->syncp, flags);
+    put_cpu_ptr(pcpu_client.stats);
+}
+
+/* ---- one read of both totals, returns the number of retries it needed ---- */
+static unsigned int hot_read(enum hot_design design, u64 *packets, u64 *bytes)
+{
+    const struct hot_stats *s;
+    unsigned int retries = 0;
+    unsigned long seq;
+    unsigned int start;
+    u64 p, b;
+    int cpu;
+
+    if (design == HOT_SEQLOCK) {
+        for (;;) {
+            seq = read_seqbegin(&seq_client.seq);
+            *packets = seq_client.packets;
+            *bytes   = seq_client.bytes;
+            if (!read_seqretry(&seq_client.seq, seq))
+                return retries;
+            retries++;
+        }
+    }
+
+    *packets = 0;
+    *bytes = 0;
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(pcpu_client.stats, cpu);
+        for (;;) {
+            start = u64_stats_fetch_begin(&s->syncp);
+            p = s->packets;
+            b = s->bytes;
+            if (!u64_stats_fetch_retry(&s->syncp, start))
+                break;
+            retries++;
+        }
+        *packets += p;
+        *bytes   += b;
+    }
+    return retries;
+}
+
+static int hot_thread_fn(void *arg)
+{
+    struct hot_thread *t = arg;
+    u64 ops = 0;
+
+    while (time_before(jiffies, deadline)) {
+        hot_update(t->design);
+        if ((++ops & 1023) == 0)
+            cond_resched();
+    }
+    t->ops = ops;
+
+    /* hot_run() collects us with kthread_stop(), never leave module code before that */
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+/* One updater per online CPU with one design, the caller reads meanwhile */
+static void hot_run(enum hot_design design, int nthreads)
+{
+    u64 ops = 0, reads = 0, retries = 0, start, elapsed, p = 0, b = 0;
+    int i, cpu, started = 0;
+
+    /* create and bind all updaters first, then wake them together */
+    for_each_online_cpu(cpu) {
+        if (started == nthreads)
+            break;
+        threads[started].design = design;
+        threads[started].ops = 0;
+        threads[started].task = kthread_create(hot_thread_fn, &threads[started],
+                                               "client_hot/%d", cpu);
+        if (IS_ERR(threads[started].task))
+            break;
+        kthread_bind(threads[started].task, cpu);
+        started++;
+    }
+
+    deadline = jiffies + msecs_to_jiffies(duration_ms);
+    start = ktime_get_ns();
+    for (i = 0; i < started; i++)
+        wake_up_process(threads[i].task);
+
+    /* the reader: shares a CPU with one updater, so give it time to run */
+    while (time_before(jiffies, deadline)) {
+        retries += hot_read(design, &p, &b);
+        if ((++reads & 255) == 0)
+            cond_resched();
+    }
+
+    /* returns once the thread is past the deadline and has exited */
+    for (i = 0; i < started; i++)
+        kthread_stop(threads[i].task);
+    elapsed = ktime_get_ns() - start;
+
+    for (i = 0; i < started; i++)
+        ops += threads[i].ops;
+
+    pr_info("client_hot: %-8s %8d %16llu %16llu %12llu %12llu\n",
+            design_names[design], started, div64_u64(ops * NSEC_PER_SEC, elapsed ?: 1),
+            div64_u64(reads * NSEC_PER_SEC, elapsed ?: 1), retries, p);
+}
+
+static int __init client_hot_init(void)
+{
+    int cpu, nr_online;
+
+    if (duration_ms <= 0)
+        return -EINVAL;
+
+    pcpu_client.id = 1;
+    pcpu_client.stats = alloc_percpu(struct hot_stats);
+    if (!pcpu_client.stats)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+        u64_stats_init(&per_cpu_ptr(pcpu_client.stats, cpu)->syncp);
+
+    seq_client.id = 1;
+    seqlock_init(&seq_client.seq);
+
+    /* hold off hotplug so the thread count matches the CPUs we bind to */
+    cpus_read_lock();
+    nr_online = num_online_cpus();
+    threads = kcalloc(nr_online, sizeof(*threads), GFP_KERNEL);
+    if (!threads) {
+        cpus_read_unlock();
+        free_percpu(pcpu_client.stats);
+        return -ENOMEM;
+    }
+
+    pr_info("client_hot: %d online CPUs, %d ms per run\n", nr_online, duration_ms);
+    pr_info("client_hot: %-8s %8s %16s %16s %12s %12s\n",
+            "design", "threads", "updates/s", "reads/s", "retries", "packets");
+
+    hot_run(HOT_SEQLOCK, nr_online);
+    hot_run(HOT_PERCPU, nr_online);
+    cpus_read_unlock();
+
+    kfree(threads);
+    free_percpu(pcpu_client.stats);
+    return 0;
+}
+
+static void __exit client_hot_exit(void)
+{
+}
+
+module_init(client_hot_init);
+module_exit(client_hot_exit);
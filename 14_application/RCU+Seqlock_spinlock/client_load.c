@@ -0,0 +1,218 @@
+// client_load.c
+/*
+ * Load generator for /dev/clients (file.ko must be loaded).
+ *
+ *   ./client_load [clients] [batch] [seconds] [threads]
+ *
+ * Every thread owns its own range of clients (default 10000) and drives
+ * them through the batch ioctls, batch records per call (default 1000):
+ *
+ *   add     - add all of its clients
+ *   update  - for seconds (default 5): random clients, 1-64 packets of
+ *             64-1500 bytes each, the way a packet pipeline would report them
+ *   query   - read all of its clients back and check the totals against
+ *             what it sent
+ *   remove  - remove all of its clients
+ *
+ * For each phase the records/s and ioctl calls/s of all threads are printed.
+ *
+ * gcc -O2 -pthread -o client_load client_load.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "client_reg.h"
+
+enum { PH_ADD, PH_UPDATE, PH_QUERY, PH_REMOVE, NR_PHASES };
+static const char *const phase_names[] = { "add", "update", "query", "remove" };
+
+struct load_thread {
+    pthread_t tid;
+    int index;
+    int fd;
+    unsigned long recs[NR_PHASES];      /* records handled per phase */
+    unsigned long calls[NR_PHASES];     /* ioctls per phase */
+    unsigned long errors;               /* records with result != 0 */
+    unsigned long mismatches;           /* queried totals that differ from what was sent */
+};
+
+static int nr_clients = 10000, batch = 1000, seconds = 5, nr_threads = 1;
+static pthread_barrier_t barrier;
+static double phase_time[NR_PHASES];
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Wait for all threads, thread 0 measures how long the previous phase took */
+static void phase_sync(struct load_thread *t, int phase, double *start)
+{
+    pthread_barrier_wait(&barrier);
+    if (t->index == 0) {
+        double now = now_sec();
+
+        if (phase >= 0)
+            phase_time[phase] = now - *start;
+        *start = now;
+    }
+    pthread_barrier_wait(&barrier);
+}
+
+/* One ioctl on n records, counts it and the records that failed */
+static int do_batch(struct load_thread *t, int phase, unsigned long cmd,
+                    struct client_rec *recs, int n)
+{
+    struct client_batch b = { .count = n, .recs = (__u64)(unsigned long)recs };
+
+    if (ioctl(t->fd, cmd, &b) < 0) {
+        perror(phase_names[phase]);
+        return -1;
+    }
+    t->calls[phase]++;
+    t->recs[phase] += n;
+    t->errors += n - b.ok;
+    return 0;
+}
+
+static void *load_thread_fn(void *arg)
+{
+    struct load_thread *t = arg;
+    struct client_rec *recs = calloc(batch, sizeof(*recs));
+    /* what this thread sent to every one of its clients */
+    unsigned long long *sent_packets = calloc(nr_clients, sizeof(*sent_packets));
+    unsigned long long *sent_bytes = calloc(nr_clients, sizeof(*sent_bytes));
+    unsigned int seed = t->index * 7919 + 1;
+    int first = t->index * nr_clients + 1;
+    double start = 0, end;
+    int i, n, done;
+
+    if (!recs || !sent_packets || !sent_bytes) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    phase_sync(t, -1, &start);
+
+    /* add and remove: ids in order, batch at a time */
+    for (done = 0; done < nr_clients; done += n) {
+        n = nr_clients - done < batch ? nr_clients - done : batch;
+        for (i = 0; i < n; i++)
+            recs[i] = (struct client_rec){ .id = first + done + i };
+        if (do_batch(t, PH_ADD, CLIENT_ADD_N, recs, n))
+            break;
+    }
+    phase_sync(t, PH_ADD, &start);
+
+    end = now_sec() + seconds;
+    while (now_sec() < end) {
+        for (i = 0; i < batch; i++) {
+            int k = rand_r(&seed) % nr_clients;
+            unsigned int packets = 1 + rand_r(&seed) % 64;
+            unsigned int bytes = packets * (64 + rand_r(&seed) % 1437);
+
+            recs[i] = (struct client_rec){ .id = first + k, .packets = packets, .bytes = bytes };
+            sent_packets[k] += packets;
+            sent_bytes[k] += bytes;
+        }
+        if (do_batch(t, PH_UPDATE, CLIENT_UPDATE_N, recs, batch))
+            break;
+    }
+    phase_sync(t, PH_UPDATE, &start);
+
+    for (done = 0; done < nr_clients; done += n) {
+        n = nr_clients - done < batch ? nr_clients - done : batch;
+        for (i = 0; i < n; i++)
+            recs[i] = (struct client_rec){ .id = first + done + i };
+        if (do_batch(t, PH_QUERY, CLIENT_QUERY_N, recs, n))
+            break;
+        for (i = 0; i < n; i++)
+            if (recs[i].result == 0 && (recs[i].packets != sent_packets[done + i] ||
+                                        recs[i].bytes != sent_bytes[done + i]))
+                t->mismatches++;
+    }
+    phase_sync(t, PH_QUERY, &start);
+
+    for (done = 0; done < nr_clients; done += n) {
+        n = nr_clients - done < batch ? nr_clients - done : batch;
+        for (i = 0; i < n; i++)
+            recs[i] = (struct client_rec){ .id = first + done + i };
+        if (do_batch(t, PH_REMOVE, CLIENT_REMOVE_N, recs, n))
+            break;
+    }
+    phase_sync(t, PH_REMOVE, &start);
+
+    free(sent_bytes);
+    free(sent_packets);
+    free(recs);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct load_thread *threads;
+    unsigned long errors = 0, mismatches = 0;
+    int fd, i, p;
+
+    if (argc > 1) nr_clients = atoi(argv[1]);
+    if (argc > 2) batch = atoi(argv[2]);
+    if (argc > 3) seconds = atoi(argv[3]);
+    if (argc > 4) nr_threads = atoi(argv[4]);
+    if (nr_clients < 1 || batch < 1 || batch > CLIENT_BATCH_MAX || seconds < 1 ||
+        nr_threads < 1 || (long long)nr_clients * nr_threads > 0x7fffffff) {
+        fprintf(stderr, "usage: %s [clients] [batch 1-%d] [seconds] [threads]\n",
+                argv[0], CLIENT_BATCH_MAX);
+        return 1;
+    }
+
+    fd = open("/dev/clients", O_RDWR);
+    if (fd < 0) {
+        perror("open /dev/clients");
+        return 1;
+    }
+
+    threads = calloc(nr_threads, sizeof(*threads));
+    pthread_barrier_init(&barrier, NULL, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        threads[i].index = i;
+        threads[i].fd = fd;
+        pthread_create(&threads[i].tid, NULL, load_thread_fn, &threads[i]);
+    }
+    for (i = 0; i < nr_threads; i++)
+        pthread_join(threads[i].tid, NULL);
+
+    printf("client_load: %d threads x %d clients, %d records per call\n",
+           nr_threads, nr_clients, batch);
+    printf("%-8s %12s %14s %12s %10s\n", "phase", "records", "records/s", "calls/s", "ns/record");
+    for (p = 0; p < NR_PHASES; p++) {
+        unsigned long recs = 0, calls = 0;
+        double secs = phase_time[p] > 0 ? phase_time[p] : 1e-9;
+
+        for (i = 0; i < nr_threads; i++) {
+            recs += threads[i].recs[p];
+            calls += threads[i].calls[p];
+        }
+        printf("%-8s %12lu %14.0f %12.0f %10.0f\n", phase_names[p], recs, recs / secs,
+               calls / secs, recs ? secs * 1e9 / recs * nr_threads : 0);
+    }
+
+    for (i = 0; i < nr_threads; i++) {
+        errors += threads[i].errors;
+        mismatches += threads[i].mismatches;
+    }
+    printf("failed records: %lu, wrong totals: %lu\n", errors, mismatches);
+
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+    close(fd);
+    return errors || mismatches;
+}
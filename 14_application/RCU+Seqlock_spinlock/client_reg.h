@@ -0,0 +1,33 @@
+/* client_reg.h - ioctl interface of the client registry (/dev/clients) */
+#ifndef CLIENT_REG_H
+#define CLIENT_REG_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Every command works on an array of records, so one syscall can add,
+ * remove, update or query thousands of clients. Each record gets its own
+ * result; a failing record does not stop the rest of the batch.
+ */
+#define CLIENT_ADD_N     _IOWR('c', 1, struct client_batch)    /* add ids (stats start at 0) */
+#define CLIENT_REMOVE_N  _IOWR('c', 2, struct client_batch)    /* remove ids */
+#define CLIENT_UPDATE_N  _IOWR('c', 3, struct client_batch)    /* add packets/bytes to ids */
+#define CLIENT_QUERY_N   _IOWR('c', 4, struct client_batch)    /* read totals of ids */
+
+#define CLIENT_BATCH_MAX 65536      /* records in one call */
+
+struct client_rec {
+    __s32 id;               /* in */
+    __s32 result;           /* out: 0, -EEXIST (add), -ENOENT, -ENOMEM ... */
+    __u64 packets;          /* UPDATE: in, added to the client; QUERY: out, total */
+    __u64 bytes;            /* same as packets */
+};
+
+struct client_batch {
+    __u32 count;            /* in: records at recs, at most CLIENT_BATCH_MAX */
+    __u32 ok;               /* out: records whose result is 0 */
+    __u64 recs;             /* in: user pointer to struct client_rec[count] */
+};
+
+#endif
@@ -1,169 +1,397 @@
 #include <linux/module.h>
 #include <linux/slab.h>
-#include <linux/list.h>
-#include <linux/rculist.h>     /* <-- required for list_for_each_entry_rcu */
+#include <linux/rhashtable.h>  /* RCU protected, resizable hash table */
 #include <linux/rcupdate.h>
-#include <linux/spinlock.h>
-#include <linux/seqlock.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/types.h>
 #include <linux/printk.h>
+#include <linux/cdev.h>
+#include <linux/fs.h>
+#include <linux/device.h>
+#include <linux/uaccess.h>
+#include <linux/sched.h>
+#include "client_reg.h"
 
 
 MODULE_LICENSE("GPL");
 
-struct client {
-    int id;
-    struct list_head list;
+#define DEVICE_NAME "clients"
+#define CLASS_NAME  "clients_class"
 
-    seqlock_t seq;
+/*
+ * One CPU's share of a client's stats. Only that CPU writes it, so updates
+ * need no lock and never touch another CPU's cache line. syncp keeps the
+ * packets/bytes pair consistent for readers on 32-bit (on 64-bit it is empty).
+ */
+struct client_stats {
     u64 packets;
     u64 bytes;
+    struct u64_stats_sync syncp;
 };
 
-/* Global list + lock */
-static LIST_HEAD(client_list);
-static spinlock_t client_lock;
+/*
+ * Lookups only read the first cache line (id, node, stats pointer), and
+ * nothing writes it after the insert. The counters live in per-CPU memory,
+ * and every client starts on its own cache line, so updates on one CPU no
+ * longer bounce the line that lookups on all the others need.
+ */
+struct client {
+    int id;
+    struct rhash_head node;     /* in client_ht, keyed by id */
+    struct client_stats __percpu *stats;
+    struct rcu_head rcu;        /* deferred free after removal */
+} ____cacheline_aligned_in_smp;
+
+/* All struct client objects come from here: no kmalloc size rounding, hot objects */
+static struct kmem_cache *client_cache;
+
+/*
+ * All clients, hashed by id. Lookups run under rcu_read_lock() only and
+ * take O(1) whatever the number of clients; inserts and removes lock one
+ * bucket inside the rhashtable. The table grows and shrinks by itself.
+ */
+static struct rhashtable client_ht;
+
+static const struct rhashtable_params client_ht_params = {
+    .key_len             = sizeof(int),
+    .key_offset          = offsetof(struct client, id),
+    .head_offset         = offsetof(struct client, node),
+    .automatic_shrinking = true,
+};
 
 /* ---------- Helpers ---------- */
 
-static void client_init(struct client *c, int id)
+/* Returns 0 or -ENOMEM */
+static int client_init(struct client *c, int id)
 {
+    int cpu;
+
     c->id = id;
-    INIT_LIST_HEAD(&c->list);
-    seqlock_init(&c->seq);
-    c->packets = 0;
-    c->bytes = 0;
+    c->stats = alloc_percpu(struct client_stats);
+    if (!c->stats)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu)
+        u64_stats_init(&per_cpu_ptr(c->stats, cpu)->syncp);
+    return 0;
+}
+
+static void client_destroy(struct client *c)
+{
+    free_percpu(c->stats);
+    kmem_cache_free(client_cache, c);
+}
+
+/* Client with this id or NULL. Caller holds rcu_read_lock(). */
+static struct client *client_lookup(int id)
+{
+    return rhashtable_lookup(&client_ht, &id, client_ht_params);
 }
 
 static bool find_client_and_read_stats(int id, u64 *packets, u64 *bytes)
 {
+    const struct client_stats *s;
     struct client *c;
-    unsigned long seq;
+    unsigned int start;
+    u64 p, b;
+    int cpu;
 
     rcu_read_lock();
 
-    list_for_each_entry_rcu(c, &client_list, list) {
-        if (c->id == id) {
+    c = client_lookup(id);
+    if (c) {
+        *packets = 0;
+        *bytes = 0;
+        /*
+         * Sum of all shards. A retry only repeats one shard, and only when
+         * its own CPU wrote it in the middle of the copy (never on 64-bit),
+         * so readers cannot be starved by busy writers.
+         */
+        for_each_possible_cpu(cpu) {
+            s = per_cpu_ptr(c->stats, cpu);
             do {
-                seq = read_seqbegin(&c->seq);
-                *packets = c->packets;
-                *bytes   = c->bytes;
-            } while (read_seqretry(&c->seq, seq));
-
-            rcu_read_unlock();
-            return true;
+                start = u64_stats_fetch_begin(&s->syncp);
+                p = s->packets;
+                b = s->bytes;
+            } while (u64_stats_fetch_retry(&s->syncp, start));
+            *packets += p;
+            *bytes   += b;
         }
     }
 
     rcu_read_unlock();
-    return false;
+    return c != NULL;
 }
 
+/* Any context; caller holds rcu_read_lock() (or otherwise keeps c alive) */
 static void update_client_stats(struct client *c, u64 add_packets, u64 add_bytes)
 {
-    write_seqlock(&c->seq);
-    c->packets += add_packets;
-    c->bytes   += add_bytes;
-    write_sequnlock(&c->seq);
+    struct client_stats *s;
+    unsigned long flags;
+
+    /* stay on this CPU, and keep interrupts out of the syncp section */
+    s = get_cpu_ptr(c->stats);
+    flags = u64_stats_update_begin_irqsave(&s->syncp);
+    s->packets += add_packets;
+    s->bytes   += add_bytes;
+    u64_stats_update_end_irqrestore(&s->syncp, flags);
+    put_cpu_ptr(c->stats);
 }
 
 /* ---------- Add / Remove Clients ---------- */
 
-static void add_client(int id)
+/* Returns 0, -ENOMEM or -EEXIST if a client with this id is already there */
+static int add_client(int id)
 {
     struct client *c;
+    int ret;
 
-    c = kmalloc(sizeof(*c), GFP_KERNEL);
+    c = kmem_cache_alloc(client_cache, GFP_KERNEL);
     if (!c)
-        return;
+        return -ENOMEM;
 
-    client_init(c, id);
+    ret = client_init(c, id);
+    if (ret) {
+        kmem_cache_free(client_cache, c);
+        return ret;
+    }
 
-    spin_lock(&client_lock);
-    list_add_rcu(&c->list, &client_list);
-    spin_unlock(&client_lock);
+    /* checks for a duplicate id and inserts under the same bucket lock */
+    ret = rhashtable_lookup_insert_fast(&client_ht, &c->node, client_ht_params);
+    if (ret) {
+        /* never visible to readers, no grace period needed */
+        client_destroy(c);
+        return ret;
+    }
 
-    pr_info("Added client %d\n", id);
+    /* pr_debug: batches add thousands of clients per call */
+    pr_debug("Added client %d\n", id);
+    return 0;
 }
 
-static void remove_client(int id)
+/* Runs after a grace period: no reader can still see the client */
+static void client_free_rcu(struct rcu_head *head)
 {
-    struct client *c, *tmp;
+    client_destroy(container_of(head, struct client, rcu));
+}
 
-    spin_lock(&client_lock);
+/*
+ * Returns 0 or -ENOENT. Does not wait for readers: the client is freed by
+ * call_rcu() once the current grace period ends, so a caller removing
+ * thousands of clients pays for no grace period at all.
+ */
+static int remove_client(int id)
+{
+    struct client *c;
+    int ret = -ENOENT;
 
-    list_for_each_entry_safe(c, tmp, &client_list, list) {
-        if (c->id == id) {
-            list_del_rcu(&c->list);
-            spin_unlock(&client_lock);
+    rcu_read_lock();
+    c = client_lookup(id);
+    /* only one of several racing removers gets 0 back and frees c */
+    if (c)
+        ret = rhashtable_remove_fast(&client_ht, &c->node, client_ht_params);
+    rcu_read_unlock();
 
-            synchronize_rcu();
-            kfree(c);
+    if (ret)
+        return ret;
 
-            pr_info("Removed client %d\n", id);
-            return;
-        }
-    }
+    call_rcu(&c->rcu, client_free_rcu);
 
-    spin_unlock(&client_lock);
+    pr_debug("Removed client %d\n", id);
+    return 0;
 }
 
 /* ---------- Cleanup ---------- */
 
+static void client_free(void *ptr, void *arg)
+{
+    struct client *c = ptr;
+
+    call_rcu(&c->rcu, client_free_rcu);
+}
+
+/*
+ * Module exit only: no lookup or update may run any more. Queues every
+ * client for freeing, then one rcu_barrier() waits for all pending
+ * callbacks (including earlier removals) before the cache goes away.
+ */
 static void cleanup_all_clients(void)
 {
-    struct client *c, *tmp;
-    LIST_HEAD(tmp_list);
+    rhashtable_free_and_destroy(&client_ht, client_free, NULL);
+    rcu_barrier();
+    kmem_cache_destroy(client_cache);
+}
+
+/* ---------- Char Device ---------- */
+
+static dev_t devt;
+static struct cdev client_cdev;
+static struct class *client_class;
+
+/* Records copied in and out per step, so a batch needs no big kernel buffer */
+#define CLIENT_CHUNK 256
+
+/* Run one command on one record, fills in rec->result (and the stats for QUERY) */
+static void client_do_rec(unsigned int cmd, struct client_rec *rec)
+{
+    struct client *c;
 
-    spin_lock(&client_lock);
-    list_for_each_entry_safe(c, tmp, &client_list, list) {
-        list_move_tail(&c->list, &tmp_list);
+    switch (cmd) {
+    case CLIENT_ADD_N:
+        rec->result = add_client(rec->id);
+        break;
+    case CLIENT_REMOVE_N:
+        rec->result = remove_client(rec->id);
+        break;
+    case CLIENT_UPDATE_N:
+        rcu_read_lock();
+        c = client_lookup(rec->id);
+        if (c)
+            update_client_stats(c, rec->packets, rec->bytes);
+        rcu_read_unlock();
+        rec->result = c ? 0 : -ENOENT;
+        break;
+    case CLIENT_QUERY_N:
+        if (find_client_and_read_stats(rec->id, &rec->packets, &rec->bytes)) {
+            rec->result = 0;
+        } else {
+            rec->packets = 0;
+            rec->bytes = 0;
+            rec->result = -ENOENT;
+        }
+        break;
     }
-    spin_unlock(&client_lock);
+}
+
+/*
+ * All four commands: walk the user's records CLIENT_CHUNK at a time, run
+ * the command on each and copy the results back. Returns 0 even if some
+ * records failed (batch.ok says how many did not), -EFAULT or -EINVAL
+ * only for a bad batch, or -EINTR if a signal stopped a long one early.
+ */
+static long client_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct client_batch __user *ubatch = (struct client_batch __user *)arg;
+    struct client_rec __user *urecs;
+    struct client_batch batch;
+    struct client_rec *recs;
+    u32 done, n, i;
+    long ret = 0;
+
+    if (cmd != CLIENT_ADD_N && cmd != CLIENT_REMOVE_N &&
+        cmd != CLIENT_UPDATE_N && cmd != CLIENT_QUERY_N)
+        return -ENOTTY;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.count > CLIENT_BATCH_MAX)
+        return -EINVAL;
+    urecs = u64_to_user_ptr(batch.recs);
+
+    recs = kmalloc_array(CLIENT_CHUNK, sizeof(*recs), GFP_KERNEL);
+    if (!recs)
+        return -ENOMEM;
+
+    batch.ok = 0;
+    for (done = 0; done < batch.count; done += n) {
+        n = min_t(u32, batch.count - done, CLIENT_CHUNK);
+        if (copy_from_user(recs, urecs + done, n * sizeof(*recs))) {
+            ret = -EFAULT;
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            client_do_rec(cmd, &recs[i]);
+            batch.ok += recs[i].result == 0;
+        }
 
-    synchronize_rcu();
+        if (copy_to_user(urecs + done, recs, n * sizeof(*recs))) {
+            ret = -EFAULT;
+            break;
+        }
 
-    list_for_each_entry_safe(c, tmp, &tmp_list, list) {
-        list_del(&c->list);
-        kfree(c);
+        /* a batch of 65536 adds takes a while: stay preemptible and killable */
+        cond_resched();
+        if (signal_pending(current) && done + n < batch.count) {
+            ret = -EINTR;
+            break;
+        }
     }
+    kfree(recs);
+
+    /* ok also tells a caller after -EINTR how far the batch got */
+    if (copy_to_user(&ubatch->ok, &batch.ok, sizeof(batch.ok)))
+        return -EFAULT;
+    return ret;
 }
 
+static const struct file_operations client_fops = {
+    .owner          = THIS_MODULE,
+    .unlocked_ioctl = client_ioctl,
+};
+
 /* ---------- Module Init ---------- */
 
 static int __init client_module_init(void)
 {
-    struct client *c;
-    u64 p, b;
+    struct device *dev;
+    int ret;
 
     pr_info("client_mod: init\n");
 
-    spin_lock_init(&client_lock);
+    client_cache = KMEM_CACHE(client, 0);
+    if (!client_cache)
+        return -ENOMEM;
 
-    /* Add clients */
-    add_client(1);
-    add_client(2);
+    ret = rhashtable_init(&client_ht, &client_ht_params);
+    if (ret) {
+        kmem_cache_destroy(client_cache);
+        return ret;
+    }
 
-    /* Update stats */
-    rcu_read_lock();
-    list_for_each_entry_rcu(c, &client_list, list) {
+    /* clients come and go through the ioctls of /dev/clients, see client_reg.h */
+    ret = alloc_chrdev_region(&devt, 0, 1, DEVICE_NAME);
+    if (ret) {
+        pr_err("client_mod: alloc_chrdev_region failed: %d\n", ret);
+        goto err_table;
+    }
 
-        if (c->id == 1)
-            update_client_stats(c, 10, 100);
+    cdev_init(&client_cdev, &client_fops);
+    client_cdev.owner = THIS_MODULE;
 
-        else if (c->id == 2)
-            update_client_stats(c, 5, 50);
+    ret = cdev_add(&client_cdev, devt, 1);
+    if (ret) {
+        pr_err("client_mod: cdev_add failed: %d\n", ret);
+        goto err_region;
     }
-    rcu_read_unlock();
 
-    /* Print stats */
-    if (find_client_and_read_stats(1, &p, &b))
-        pr_info("Client 1 stats: packets=%llu bytes=%llu\n", p, b);
+    client_class = class_create(THIS_MODULE, CLASS_NAME);
+    if (IS_ERR(client_class)) {
+        pr_err("client_mod: class_create failed\n");
+        ret = PTR_ERR(client_class);
+        goto err_cdev;
+    }
 
-    if (find_client_and_read_stats(2, &p, &b))
-        pr_info("Client 2 stats: packets=%llu bytes=%llu\n", p, b);
+    dev = device_create(client_class, NULL, devt, NULL, DEVICE_NAME);
+    if (IS_ERR(dev)) {
+        pr_err("client_mod: device_create failed\n");
+        ret = PTR_ERR(dev);
+        goto err_class;
+    }
 
+    pr_info("client_mod: registered /dev/%s major=%u\n", DEVICE_NAME, MAJOR(devt));
     return 0;
+
+err_class:
+    class_destroy(client_class);
+err_cdev:
+    cdev_del(&client_cdev);
+err_region:
+    unregister_chrdev_region(devt, 1);
+err_table:
+    cleanup_all_clients();
+    return ret;
 }
 
 /* ---------- Module Exit ---------- */
@@ -171,6 +399,11 @@ static int __init client_module_init(void)
 static void __exit client_module_exit(void)
 {
     pr_info("client_mod: exit\n");
+    /* open files hold a module reference: no ioctl is running any more */
+    device_destroy(client_class, devt);
+    class_destroy(client_class);
+    cdev_del(&client_cdev);
+    unregister_chrdev_region(devt, 1);
     cleanup_all_clients();
     pr_info("client_mod: cleanup complete\n");
 }
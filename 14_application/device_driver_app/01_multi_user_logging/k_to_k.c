@@ -2,8 +2,8 @@
 #include <linux/kernel.h>
 #include <linux/string.h>   // Required for strlen()
 
-// This function is implemented in mblog driver and exported using EXPORT_SYMBOL
-extern void mblog_write_kernel(const char *msg, size_t len);
+// mblog_write_kernel() is implemented in mblog driver and exported using EXPORT_SYMBOL
+#include "mblog_kernel.h"
 
 // Module initialization function (runs when module is inserted)
 static int __init klogger_init(void)
@@ -0,0 +1,167 @@
+// mblog.h - definitions shared by the mblog driver and its user space programs
+#ifndef MBLOG_H
+#define MBLOG_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// IOCTL commands
+#define MBLOG_CLEAR       _IO('m', 1)                               // Clear log buffer
+#define MBLOG_GET_SIZE    _IOR('m', 2, size_t)                      // Get current log size
+#define MBLOG_SET_MODE    _IOW('m', 3, int)                         // MBLOG_MODE_STOP / MBLOG_MODE_OVERWRITE
+#define MBLOG_GET_MISSED  _IOR('m', 4, struct mblog_seq_info)       // Records this reader never saw
+#define MBLOG_SET_FORMAT  _IOW('m', 5, int)                         // MBLOG_FMT_TEXT / MBLOG_FMT_RECORD
+#define MBLOG_GET_DROPPED _IOR('m', 6, __u64)                       // Records rejected by full rings
+#define MBLOG_SET_FOLLOW  _IOW('m', 7, int)                         // 1: read() waits for new data
+#define MBLOG_SET_LOWAT   _IOW('m', 8, __u32)                       // Pending bytes that wake read()/poll()
+#define MBLOG_REGISTER    _IOW('m', 9, struct mblog_consumer_reg)   // Make this file a registered consumer
+#define MBLOG_UNREGISTER  _IO('m', 10)                              // Back to a plain reader
+#define MBLOG_GET_CONSUMERS _IOWR('m', 11, struct mblog_consumers)  // Lag of every registered consumer
+#define MBLOG_SET_RING_SIZE _IOWR('m', 12, __u64)                   // Resize every CPU ring (root, fails while mmap()ed)
+#define MBLOG_SET_RATELIMIT _IOW('m', 13, struct mblog_ratelimit)   // Token bucket of a writer class or process
+#define MBLOG_GET_STATS   _IOWR('m', 14, struct mblog_stats)        // Accepted/throttled/dropped bytes per source
+
+// What a writer does when its ring is full
+#define MBLOG_MODE_STOP       0     // reject the new record with -ENOSPC
+#define MBLOG_MODE_OVERWRITE  1     // drop the oldest records to make room
+
+// What read() returns on one open file
+#define MBLOG_FMT_TEXT      0   // payload bytes only, records concatenated (default)
+#define MBLOG_FMT_RECORD    1   // whole records: struct mblog_rec + payload, padded to MBLOG_REC_SIZE()
+
+// Per open file sequence accounting (every record carries a per-CPU sequence number)
+struct mblog_seq_info {
+    __u64 records;      // records returned by read() on this file
+    __u64 missed;       // records overwritten or cleared before this file read them
+};
+
+/*
+ * Registered consumers. Every open file already reads with its own cursors;
+ * registering one also makes the driver keep every record until all
+ * registered consumers have read it: space is reclaimed behind the slowest
+ * one, and MBLOG_CLEAR on a consumer only skips its own unread records.
+ * While consumers exist, MBLOG_CLEAR on other files fails with -EBUSY.
+ * In overwrite mode writers still make room, and a slow consumer sees the
+ * lost records in its MBLOG_GET_MISSED count.
+ * The driver's spill thread (module parameter spill_path or sysfs
+ * spill/path) is a consumer named "spill"; its file holds the records
+ * back to back in the MBLOG_FMT_RECORD layout.
+ */
+#define MBLOG_NAME_LEN  16
+
+struct mblog_consumer_reg {
+    char name[MBLOG_NAME_LEN];  // shown by MBLOG_GET_CONSUMERS, need not be unique
+};
+
+struct mblog_consumer_info {
+    char name[MBLOG_NAME_LEN];
+    __u32 id;           // assigned at registration
+    __u32 pid;          // process that registered
+    __u64 lag;          // bytes (headers included) this consumer has not read yet
+    __u64 records;      // records it has read
+    __u64 missed;       // records it lost to overwrite mode
+};
+
+struct mblog_consumers {
+    __u32 count;        // in: entries available, out: consumers registered
+    __u32 slowest_id;   // consumer with the largest lag (0 if none)
+    __u64 max_lag;      // its lag in bytes
+    __u64 entries;      // user pointer to struct mblog_consumer_info[count], may be 0
+};
+
+/*
+ * Writers are accounted per source: one per user process (tgid) and one
+ * per kernel call site of mblog_write_kernel*(). Each source has a token
+ * bucket; a write that finds too few tokens is throttled: write() fails
+ * with -EAGAIN and mblog_write_kernel_atomic() returns false.
+ * A process's source (with its limit and counters) ends with the process:
+ * a limit can only be set for a running pid (-ESRCH otherwise) and is not
+ * inherited by a later process that gets the same pid.
+ */
+struct mblog_ratelimit {
+    __u32 type;         // MBLOG_SRC_USER or MBLOG_SRC_KERNEL
+    __u32 pid;          // MBLOG_SRC_USER only: one process, 0 = default for all of them
+    __u64 rate;         // bytes per second, 0 = unlimited (for one pid: use the default)
+    __u64 burst;        // bucket size in bytes, 0 = one second worth of rate
+};
+
+struct mblog_source_stats {
+    char name[32];      // "pid 1234" or the kernel caller ("my_irq_handler+0x4c")
+    __u32 type;         // MBLOG_SRC_*
+    __u32 pid;          // 0 for kernel sources
+    __u64 accepted;     // payload bytes logged
+    __u64 throttled;    // payload bytes refused by the rate limit
+    __u64 dropped;      // payload bytes refused because the ring was full (stop mode)
+};
+
+struct mblog_stats {
+    __u32 count;        // in: entries available, out: sources known
+    __u32 pad;
+    __u64 accepted;     // totals over all sources
+    __u64 throttled;
+    __u64 dropped;
+    __u64 entries;      // user pointer to struct mblog_source_stats[count], may be 0
+};
+
+/*
+ * Every write becomes one record in the ring of the CPU it ran on:
+ * this header followed by len payload bytes, padded to MBLOG_REC_ALIGN.
+ * The same layout is returned by read() in MBLOG_FMT_RECORD and seen
+ * through mmap(), so readers can skip records by header alone.
+ */
+struct mblog_rec {
+    __u32 len;          // payload length
+    __u32 pid;          // writer process (tgid), 0 outside process context
+    __u64 seq;          // per-CPU sequence number, gaps tell readers what they missed
+    __u64 ts;           // CLOCK_MONOTONIC nanoseconds when the record was written
+    __u16 cpu;          // CPU whose ring holds the record
+    __u16 source;       // MBLOG_SRC_*
+    __u32 pad;
+};
+
+// Who wrote a record
+#define MBLOG_SRC_USER      0   // write() on /dev/mblog
+#define MBLOG_SRC_KERNEL    1   // mblog_write_kernel() from another module
+
+// Largest payload of one record: write() splits longer iovecs into several records
+#define MBLOG_MAX_RECORD    1024
+
+#define MBLOG_REC_ALIGN     8
+#define MBLOG_REC_SIZE(len) (((sizeof(struct mblog_rec) + (len)) + MBLOG_REC_ALIGN - 1) & \
+                             ~(MBLOG_REC_ALIGN - 1))
+
+/*
+ * mmap() layout of /dev/mblog (read-only):
+ *
+ *   [ struct mblog_mmap_hdr + one mblog_ring_ctl per CPU ][ ring 0 ][ ring 1 ] ...
+ *
+ * Ring i starts at data_offset + i * ring_size. head and tail are free
+ * running byte positions, (pos & (ring_size - 1)) is the offset inside the
+ * ring. A record is valid only if tail has not passed it after it was copied.
+ * History moved into compressed cold segments (module parameter cold_kb)
+ * is only returned by read().
+ *
+ * head and tail are the kernel's native word, which the writers update with
+ * single-word atomics, so user space must have the same word size: a 32-bit
+ * process on a 64-bit kernel gets -EINVAL from mmap() and has to use read().
+ */
+#define MBLOG_MMAP_VERSION  2
+
+struct mblog_ring_ctl {
+    unsigned long head;     // next write position, published with release semantics
+    unsigned long tail;     // oldest byte still held
+    __u32 present;          // 0 if this CPU cannot exist (its ring is not mapped)
+    __u32 pad;
+} __attribute__((aligned(64)));     // one cache line per CPU
+
+struct mblog_mmap_hdr {
+    __u32 version;
+    __u32 nr_rings;
+    __u64 ring_size;
+    __u64 data_offset;
+    __u64 map_size;         // length to pass to mmap() to see every ring
+    __u8  pad[32];
+    struct mblog_ring_ctl rings[];
+};
+
+#endif
@@ -0,0 +1,52 @@
+// mblog_batch.h - collect log lines in user space and send them to /dev/mblog with one writev()
+//
+// Every line added becomes one record; mblog_batch_flush() appends them all
+// under a single reservation in the driver, so a batch of N lines costs one
+// system call instead of N. Lines are not copied: they must stay valid until
+// the batch is flushed.
+#ifndef MBLOG_BATCH_H
+#define MBLOG_BATCH_H
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MBLOG_BATCH_MAX 64  // lines per writev() call
+
+struct mblog_batch {
+    int fd;
+    int count;
+    struct iovec iov[MBLOG_BATCH_MAX];
+};
+
+static inline void mblog_batch_init(struct mblog_batch *b, int fd)
+{
+    b->fd = fd;
+    b->count = 0;
+}
+
+// Send the queued lines. Returns the bytes logged or -1 with errno set.
+static inline ssize_t mblog_batch_flush(struct mblog_batch *b)
+{
+    ssize_t ret;
+
+    if (!b->count)
+        return 0;
+    ret = writev(b->fd, b->iov, b->count);
+    b->count = 0;
+    return ret;
+}
+
+// Queue one line, flushing first when the batch is full
+static inline ssize_t mblog_batch_add(struct mblog_batch *b, const void *line, size_t len)
+{
+    ssize_t ret = 0;
+
+    if (b->count == MBLOG_BATCH_MAX)
+        ret = mblog_batch_flush(b);
+    b->iov[b->count].iov_base = (void *)line;
+    b->iov[b->count].iov_len = len;
+    b->count++;
+    return ret;
+}
+
+#endif
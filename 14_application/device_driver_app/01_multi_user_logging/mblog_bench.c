@@ -0,0 +1,293 @@
+// mblog_bench.c - measure how mblog write throughput scales with the number of cores
+//
+// For 1, 2, 4 ... N threads, every thread is pinned to its own CPU, opens
+// /dev/mblog and writes fixed size lines for a few seconds. The total number
+// of records logged per second is printed for each thread count, with the
+// p50/p99/p999 latency of one write()/writev() call and the records dropped.
+// A line is one record unless it is longer than MBLOG_MAX_RECORD.
+//
+// One more thread drains the log as a registered consumer, the way a real
+// reader would. Calls it could not make room for in time fail with ENOSPC
+// and are counted as full; calls refused by the rate limiter (EAGAIN) are
+// counted as throttled. Writers only use CPUs this process may run on.
+//
+// With batch > 1 each thread sends batch lines per writev() call, so the
+// system call cost is shared by the whole batch (try 1, 16 and 256; a batch
+// must fit in one CPU ring, 256 lines of 64 bytes need bufsize >= 32768).
+// With format "json" every step is printed as one JSON object per line
+// (for scripts that compare runs), otherwise as a table.
+//
+// Build: gcc -O2 -pthread -o mblog_bench mblog_bench.c
+// Usage: ./mblog_bench [max_threads] [line_size] [seconds] [batch] [text|json]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include "mblog.h"
+
+#define DEVICE "/dev/mblog"  // Device file path
+
+// One call in SAMPLE_EVERY is timed, up to MAX_SAMPLES per thread
+#define SAMPLE_EVERY 16
+#define MAX_SAMPLES  (1 << 18)
+
+struct worker {
+    pthread_t tid;
+    int cpu;
+    unsigned long writes;   // records accepted
+    unsigned long full;     // calls rejected with ENOSPC
+    unsigned long throttled;    // calls rejected by the rate limiter (EAGAIN)
+    unsigned long *lat;     // sampled call latencies in ns
+    int nr_lat;
+};
+
+static volatile int stop, drain_stop;
+static cpu_set_t cpus;      // online CPUs we are allowed on, writer i gets the i-th
+static int line_size = 64;
+static int batch = 1;       // lines per writev() call
+static int recs_per_line;   // records the driver splits one line into
+static int json;
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// The i-th CPU in cpus
+static int nth_cpu(int i)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &cpus) && i-- == 0)
+            return cpu;
+    return 0;
+}
+
+// Registered consumer: reads everything the writers log so their rings keep room
+static void *drain(void *arg)
+{
+    static char buf[256 * 1024];
+    int fd = *(int *)arg;
+
+    while (!drain_stop) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+        poll(&pfd, 1, 100);
+        while (read(fd, buf, sizeof(buf)) > 0)
+            ;
+    }
+    return NULL;
+}
+
+static void *writer(void *arg)
+{
+    struct worker *w = arg;
+    unsigned long calls = 0, t0 = 0;
+    struct iovec *iov;
+    char *line;
+    cpu_set_t set;
+    ssize_t n;
+    int fd, i, timed;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    fd = open(DEVICE, O_WRONLY);
+    if (fd < 0) {
+        perror("open " DEVICE);
+        return NULL;
+    }
+
+    line = malloc(line_size);
+    memset(line, 'a' + w->cpu % 26, line_size);
+    line[line_size - 1] = '\n';
+
+    // All iovecs point at the same line: each one is logged as its own record
+    iov = calloc(batch, sizeof(*iov));
+    for (i = 0; i < batch; i++) {
+        iov[i].iov_base = line;
+        iov[i].iov_len = line_size;
+    }
+
+    while (!stop) {
+        timed = calls++ % SAMPLE_EVERY == 0 && w->nr_lat < MAX_SAMPLES;
+        if (timed)
+            t0 = now_ns();
+
+        n = batch == 1 ? write(fd, line, line_size) : writev(fd, iov, batch);
+
+        if (timed)
+            w->lat[w->nr_lat++] = now_ns() - t0;
+
+        if (n >= 0) {
+            // A short write can end inside a line: count the records it made
+            w->writes += n / line_size * recs_per_line +
+                         (n % line_size + MBLOG_MAX_RECORD - 1) / MBLOG_MAX_RECORD;
+        } else if (errno == ENOSPC) {
+            // The consumer fell behind: the driver counted the records as dropped
+            w->full++;
+        } else if (errno == EAGAIN) {
+            w->throttled++;
+        } else {
+            perror("write");
+            break;
+        }
+    }
+
+    free(iov);
+    free(line);
+    close(fd);
+    return NULL;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Percentile in units of 0.1% (500 = p50, 999 = p999) of sorted samples
+static unsigned long pct(unsigned long *v, long n, int per_mille)
+{
+    return n ? v[(n - 1) * per_mille / 1000] : 0;
+}
+
+static unsigned long long get_dropped(void)
+{
+    __u64 dropped = 0;
+    int fd = open(DEVICE, O_RDONLY);
+
+    if (fd >= 0) {
+        ioctl(fd, MBLOG_GET_DROPPED, &dropped);
+        close(fd);
+    }
+    return dropped;
+}
+
+static void run(int nthreads, int seconds)
+{
+    struct worker *w = calloc(nthreads, sizeof(*w));
+    unsigned long writes = 0, full = 0, throttled = 0, *lat;
+    unsigned long long dropped = get_dropped();
+    double start, elapsed;
+    long nr_lat = 0;
+    int i;
+
+    for (i = 0; i < nthreads; i++)
+        w[i].lat = malloc(MAX_SAMPLES * sizeof(*w[i].lat));
+
+    stop = 0;
+    start = now_ns() / 1e9;
+    for (i = 0; i < nthreads; i++) {
+        w[i].cpu = nth_cpu(i);
+        pthread_create(&w[i].tid, NULL, writer, &w[i]);
+    }
+
+    sleep(seconds);
+    stop = 1;
+
+    lat = malloc((size_t)nthreads * MAX_SAMPLES * sizeof(*lat));
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(w[i].tid, NULL);
+        writes += w[i].writes;
+        full += w[i].full;
+        throttled += w[i].throttled;
+        memcpy(lat + nr_lat, w[i].lat, w[i].nr_lat * sizeof(*lat));
+        nr_lat += w[i].nr_lat;
+        free(w[i].lat);
+    }
+    elapsed = now_ns() / 1e9 - start;
+    dropped = get_dropped() - dropped;
+    qsort(lat, nr_lat, sizeof(*lat), cmp_ulong);
+
+    if (json)
+        printf("{\"bench\":\"user_write\",\"threads\":%d,\"line_size\":%d,\"batch\":%d,"
+               "\"ops_per_sec\":%.0f,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,"
+               "\"full\":%lu,\"throttled\":%lu,\"drops\":%llu}\n",
+               nthreads, line_size, batch, writes / elapsed, pct(lat, nr_lat, 500),
+               pct(lat, nr_lat, 990), pct(lat, nr_lat, 999), full, throttled, dropped);
+    else
+        printf("%7d %14.0f %14.0f %9lu %9lu %9lu %10lu %10lu\n", nthreads, writes / elapsed,
+               writes / elapsed / nthreads, pct(lat, nr_lat, 500), pct(lat, nr_lat, 990),
+               pct(lat, nr_lat, 999), full, throttled);
+    fflush(stdout);
+
+    free(lat);
+    free(w);
+}
+
+int main(int argc, char *argv[])
+{
+    struct mblog_consumer_reg reg = { .name = "bench" };
+    int max_threads, seconds = 3, follow = 1, ncpu, fd, n;
+    pthread_t drainer;
+
+    // Only CPUs that are online and in our affinity mask can be pinned to
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+        perror("sched_getaffinity");
+        return 1;
+    }
+    ncpu = max_threads = CPU_COUNT(&cpus);
+
+    if (argc > 1)
+        max_threads = atoi(argv[1]);
+    if (argc > 2)
+        line_size = atoi(argv[2]);
+    if (argc > 3)
+        seconds = atoi(argv[3]);
+    if (argc > 4)
+        batch = atoi(argv[4]);
+    if (argc > 5)
+        json = !strcmp(argv[5], "json");
+
+    if (max_threads < 1 || max_threads > ncpu)
+        max_threads = ncpu;
+    if (line_size < 1)
+        line_size = 64;
+    if (batch < 1 || batch > IOV_MAX)
+        batch = 1;
+    recs_per_line = (line_size + MBLOG_MAX_RECORD - 1) / MBLOG_MAX_RECORD;
+
+    if (!json) {
+        printf("mblog write benchmark: %d byte lines, %d lines per call, %d s per step\n",
+               line_size, batch, seconds);
+        printf("%7s %14s %14s %9s %9s %9s %10s %10s\n", "threads", "records/s", "per thread",
+               "p50 ns", "p99 ns", "p999 ns", "full", "throttled");
+    }
+
+    fd = open(DEVICE, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        perror("open " DEVICE);
+        return 1;
+    }
+    if (ioctl(fd, MBLOG_SET_FOLLOW, &follow) < 0 || ioctl(fd, MBLOG_REGISTER, &reg) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+    pthread_create(&drainer, NULL, drain, &fd);
+
+    for (n = 1; n < max_threads; n *= 2)
+        run(n, seconds);
+    run(max_threads, seconds);
+
+    drain_stop = 1;
+    pthread_join(drainer, NULL);
+    close(fd);
+    return 0;
+}
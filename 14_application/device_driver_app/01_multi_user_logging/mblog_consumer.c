@@ -0,0 +1,178 @@
+// mblog_consumer.c - user space reader of the mmap()ed mblog rings
+//
+// The kernel publishes head with release semantics after a record is
+// complete and only reuses bytes after moving tail past them. So a record
+// copied out of the mapping is valid if tail has still not passed it
+// after the copy (same check the driver's own read() does).
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mblog_consumer.h"
+
+#define SEQ_UNKNOWN UINT64_MAX
+
+static inline int pos_before(unsigned long a, unsigned long b)
+{
+    return (long)(a - b) < 0;
+}
+
+static inline unsigned long load_acquire(unsigned long *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline unsigned long load_relaxed(unsigned long *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static const char *ring_data(struct mblog_consumer *c, unsigned int i)
+{
+    return (const char *)c->map + c->hdr->data_offset + (size_t)i * c->hdr->ring_size;
+}
+
+static void ring_copy_out(struct mblog_consumer *c, unsigned int i, unsigned long pos,
+                          void *dst, size_t len)
+{
+    size_t size = c->hdr->ring_size;
+    size_t off = pos & (size - 1);
+    size_t first = len < size - off ? len : size - off;
+
+    memcpy(dst, ring_data(c, i) + off, first);
+    memcpy((char *)dst + first, ring_data(c, i), len - first);
+}
+
+// Bytes are still valid if tail did not move past pos while we copied them
+static int still_valid(struct mblog_ring_ctl *ctl, unsigned long pos)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return !pos_before(pos, load_relaxed(&ctl->tail));
+}
+
+static int peek(struct mblog_consumer *c, unsigned int i, struct mblog_rec *hdr)
+{
+    struct mblog_ring_ctl *ctl = &c->hdr->rings[i];
+    unsigned long head, tail;
+
+    for (;;) {
+        head = load_acquire(&ctl->head);
+        tail = load_relaxed(&ctl->tail);
+        if (pos_before(c->pos[i], tail))
+            c->pos[i] = tail;
+        if (c->pos[i] == head)
+            return 0;
+
+        ring_copy_out(c, i, c->pos[i], hdr, sizeof(*hdr));
+        if (still_valid(ctl, c->pos[i]) && hdr->len < c->hdr->ring_size)
+            return 1;
+    }
+}
+
+int mblog_consumer_open(struct mblog_consumer *c, const char *path)
+{
+    struct mblog_mmap_hdr *h;
+    int err;
+
+    memset(c, 0, sizeof(*c));
+    c->fd = open(path, O_RDONLY);
+    if (c->fd < 0)
+        return -errno;
+
+    // Map the control area first to learn the full size
+    h = mmap(NULL, sizeof(*h), PROT_READ, MAP_SHARED, c->fd, 0);
+    if (h == MAP_FAILED)
+        goto fail;
+    if (h->version != MBLOG_MMAP_VERSION) {
+        munmap(h, sizeof(*h));
+        errno = EPROTO;
+        goto fail;
+    }
+    c->map_len = h->map_size;
+    munmap(h, sizeof(*h));
+
+    c->map = mmap(NULL, c->map_len, PROT_READ, MAP_SHARED, c->fd, 0);
+    if (c->map == MAP_FAILED) {
+        c->map = NULL;
+        goto fail;
+    }
+    c->hdr = c->map;
+
+    c->pos = calloc(c->hdr->nr_rings, sizeof(*c->pos));
+    c->next_seq = calloc(c->hdr->nr_rings, sizeof(*c->next_seq));
+    if (!c->pos || !c->next_seq) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    mblog_consumer_rewind(c);
+    return 0;
+
+fail:
+    err = -errno;
+    mblog_consumer_close(c);
+    return err;
+}
+
+void mblog_consumer_close(struct mblog_consumer *c)
+{
+    if (c->map)
+        munmap(c->map, c->map_len);
+    if (c->fd >= 0)
+        close(c->fd);
+    free(c->pos);
+    free(c->next_seq);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+void mblog_consumer_rewind(struct mblog_consumer *c)
+{
+    unsigned int i;
+
+    for (i = 0; i < c->hdr->nr_rings; i++) {
+        c->pos[i] = load_relaxed(&c->hdr->rings[i].tail);
+        c->next_seq[i] = SEQ_UNKNOWN;
+    }
+}
+
+int mblog_consumer_next(struct mblog_consumer *c, struct mblog_rec *hdr, void *buf, size_t buflen)
+{
+    struct mblog_rec h, best_h;
+    unsigned long pos;
+    unsigned int i;
+    int best;
+
+    for (;;) {
+        best = -1;
+        for (i = 0; i < c->hdr->nr_rings; i++) {
+            if (!c->hdr->rings[i].present || !peek(c, i, &h))
+                continue;
+            if (best < 0 || h.ts < best_h.ts) {
+                best = i;
+                best_h = h;
+            }
+        }
+
+        if (best < 0)
+            return 0;
+        if (best_h.len > buflen)
+            return -ENOSPC;
+
+        pos = c->pos[best];
+        ring_copy_out(c, best, pos + sizeof(best_h), buf, best_h.len);
+        if (!still_valid(&c->hdr->rings[best], pos))
+            continue;   // overwritten while copying, pick again
+
+        if (c->next_seq[best] != SEQ_UNKNOWN && best_h.seq > c->next_seq[best])
+            c->missed += best_h.seq - c->next_seq[best];
+        c->next_seq[best] = best_h.seq + 1;
+        c->records++;
+
+        c->pos[best] = pos + MBLOG_REC_SIZE(best_h.len);
+        *hdr = best_h;
+        return best_h.len;
+    }
+}
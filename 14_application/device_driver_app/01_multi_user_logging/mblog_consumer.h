@@ -0,0 +1,34 @@
+// mblog_consumer.h - follow /dev/mblog through mmap(), without read() syscalls or kernel copies
+#ifndef MBLOG_CONSUMER_H
+#define MBLOG_CONSUMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mblog.h"
+
+struct mblog_consumer {
+    int fd;
+    void *map;                      // read-only mapping of the whole log
+    size_t map_len;
+    struct mblog_mmap_hdr *hdr;
+    unsigned long *pos;             // cursor per CPU ring
+    uint64_t *next_seq;             // expected sequence number per CPU ring
+    uint64_t records;               // records returned so far
+    uint64_t missed;                // records overwritten before we got to them
+};
+
+// Map the log and place the cursors at the oldest data. Returns 0 or -errno.
+int mblog_consumer_open(struct mblog_consumer *c, const char *path);
+void mblog_consumer_close(struct mblog_consumer *c);
+
+// Move every cursor back to the oldest data still held
+void mblog_consumer_rewind(struct mblog_consumer *c);
+
+/*
+ * Copy the oldest unread record (over all CPU rings) into hdr/buf.
+ * Returns the payload length, 0 when there is nothing new, or -ENOSPC
+ * when buf is too small (the record stays unread).
+ */
+int mblog_consumer_next(struct mblog_consumer *c, struct mblog_rec *hdr, void *buf, size_t buflen);
+
+#endif
@@ -0,0 +1,240 @@
+// mblog_e2e.c - end-to-end latency of mblog: from write() in one thread to read() in another
+//
+// Writer threads, each pinned to its own CPU, put their CLOCK_MONOTONIC send
+// time into every line ("e2e <ns> ..."). The main thread follows the device
+// with a low-water mark of one byte, registered as consumer "e2e" so no
+// record is reclaimed before it is read, and for every own record computes
+//   total = time read() returned - send time
+//   queue = time read() returned - rec->ts (time the driver stored it)
+// At the end the p50/p99/p999 of both, the write rate and the records the
+// reader lost (MBLOG_GET_MISSED) are printed, as a table or one JSON line.
+//
+// Build: gcc -O2 -pthread -o mblog_e2e mblog_e2e.c
+// Usage: ./mblog_e2e [writers] [seconds] [lines_per_sec_per_writer] [line_size] [text|json]
+//        (writers 0 = one per CPU but the reader's, lines_per_sec 0 = as fast as possible)
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "mblog.h"
+
+#define DEVICE "/dev/mblog"  // Device file path
+
+#define MAX_SAMPLES (1 << 22)
+
+struct writer_arg {
+    pthread_t tid;
+    int cpu;
+    unsigned long writes;
+    unsigned long failed;   // write() errors (ENOSPC, rate limited)
+};
+
+static volatile int stop;
+static int line_size = 64;
+static long rate;           // lines per second per writer, 0 = unlimited
+
+static unsigned long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void *writer(void *arg)
+{
+    struct writer_arg *w = arg;
+    unsigned long next = now_ns();
+    char *line = malloc(line_size);
+    cpu_set_t set;
+    int fd, n;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    fd = open(DEVICE, O_WRONLY);
+    if (fd < 0) {
+        perror("open " DEVICE);
+        return NULL;
+    }
+
+    while (!stop) {
+        if (rate) {
+            // Pace the writer: sleep until the next line is due
+            struct timespec ts = { next / 1000000000UL, next % 1000000000UL };
+
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            next += 1000000000UL / rate;
+        }
+
+        n = snprintf(line, line_size, "e2e %lu ", now_ns());
+        if (n < line_size)
+            memset(line + n, '.', line_size - n);
+        line[line_size - 1] = '\n';
+
+        if (write(fd, line, line_size) == line_size)
+            w->writes++;
+        else
+            w->failed++;
+    }
+
+    free(line);
+    close(fd);
+    return NULL;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Percentile in units of 0.1% (500 = p50, 999 = p999) of sorted samples
+static unsigned long pct(unsigned long *v, long n, int per_mille)
+{
+    return n ? v[(n - 1) * per_mille / 1000] : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static char buf[256 * 1024];
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nwriters = ncpu > 1 ? ncpu - 1 : 1, seconds = 3, json = 0;
+    int follow = 1, format = MBLOG_FMT_RECORD, fd, i;
+    struct mblog_consumer_reg reg = { .name = "e2e" };
+    struct mblog_seq_info seq = { 0 };
+    unsigned long *total, *queue, writes = 0, failed = 0, end;
+    __u32 lowat = 1;
+    struct writer_arg *w;
+    long nr = 0;
+    pid_t pid = getpid();
+    ssize_t n, off;
+    double elapsed;
+
+    if (argc > 1)
+        nwriters = atoi(argv[1]);
+    if (argc > 2)
+        seconds = atoi(argv[2]);
+    if (argc > 3)
+        rate = atol(argv[3]);
+    if (argc > 4)
+        line_size = atoi(argv[4]);
+    if (argc > 5)
+        json = !strcmp(argv[5], "json");
+
+    if (nwriters < 1)
+        nwriters = ncpu > 1 ? ncpu - 1 : 1;
+    if (seconds < 1)
+        seconds = 1;
+    if (line_size < 32)
+        line_size = 32;     // room for "e2e <ns> " and the newline
+    if (rate < 0)
+        rate = 0;
+
+    // Reader: record format, follow mode, wake on every record
+    fd = open(DEVICE, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        perror("open " DEVICE);
+        return 1;
+    }
+    if (ioctl(fd, MBLOG_SET_FORMAT, &format) < 0 ||
+        ioctl(fd, MBLOG_SET_FOLLOW, &follow) < 0 ||
+        ioctl(fd, MBLOG_SET_LOWAT, &lowat) < 0 ||
+        ioctl(fd, MBLOG_REGISTER, &reg) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+
+    total = malloc(MAX_SAMPLES * sizeof(*total));
+    queue = malloc(MAX_SAMPLES * sizeof(*queue));
+    w = calloc(nwriters, sizeof(*w));
+
+    for (i = 0; i < nwriters; i++) {
+        // Leave CPU 0 to the reader when there is more than one CPU
+        w[i].cpu = ncpu > 1 ? 1 + i % (ncpu - 1) : 0;
+        pthread_create(&w[i].tid, NULL, writer, &w[i]);
+    }
+
+    end = now_ns() + seconds * 1000000000UL;
+    for (;;) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        unsigned long t;
+
+        if (!stop && now_ns() >= end) {
+            // Stop the writers, then drain what they left behind
+            stop = 1;
+            for (i = 0; i < nwriters; i++)
+                pthread_join(w[i].tid, NULL);
+        }
+
+        if (poll(&pfd, 1, 100) == 0 && stop)
+            break;      // writers gone and nothing left to read
+
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            t = now_ns();
+            for (off = 0; off < n; ) {
+                struct mblog_rec *rec = (struct mblog_rec *)(buf + off);
+                char *p = (char *)(rec + 1);
+
+                off += MBLOG_REC_SIZE(rec->len);
+                if (rec->pid != (__u32)pid || rec->len < 5 || memcmp(p, "e2e ", 4))
+                    continue;   // somebody else's record
+                if (nr < MAX_SAMPLES) {
+                    total[nr] = t - strtoul(p + 4, NULL, 10);
+                    queue[nr] = t - rec->ts;
+                    nr++;
+                }
+            }
+        }
+        if (n < 0 && errno != EAGAIN) {
+            perror("read");
+            break;
+        }
+    }
+    elapsed = seconds;
+
+    for (i = 0; i < nwriters; i++) {
+        writes += w[i].writes;
+        failed += w[i].failed;
+    }
+    ioctl(fd, MBLOG_GET_MISSED, &seq);
+    qsort(total, nr, sizeof(*total), cmp_ulong);
+    qsort(queue, nr, sizeof(*queue), cmp_ulong);
+
+    if (json) {
+        printf("{\"bench\":\"e2e\",\"threads\":%d,\"line_size\":%d,\"rate\":%ld,"
+               "\"ops_per_sec\":%.0f,\"received\":%ld,\"p50_ns\":%lu,\"p99_ns\":%lu,"
+               "\"p999_ns\":%lu,\"queue_p50_ns\":%lu,\"queue_p99_ns\":%lu,"
+               "\"queue_p999_ns\":%lu,\"failed\":%lu,\"drops\":%llu}\n",
+               nwriters, line_size, rate, writes / elapsed, nr, pct(total, nr, 500),
+               pct(total, nr, 990), pct(total, nr, 999), pct(queue, nr, 500),
+               pct(queue, nr, 990), pct(queue, nr, 999), failed,
+               (unsigned long long)seq.missed);
+    } else {
+        printf("mblog end-to-end: %d writers, %d byte lines, %ld lines/s each (0 = max), %d s\n",
+               nwriters, line_size, rate, seconds);
+        printf("written %lu (%.0f/s), failed %lu, received %ld, missed %llu\n",
+               writes, writes / elapsed, failed, nr, (unsigned long long)seq.missed);
+        printf("%-22s %10s %10s %10s\n", "latency (ns)", "p50", "p99", "p999");
+        printf("%-22s %10lu %10lu %10lu\n", "write() -> read()", pct(total, nr, 500),
+               pct(total, nr, 990), pct(total, nr, 999));
+        printf("%-22s %10lu %10lu %10lu\n", "stored -> read()", pct(queue, nr, 500),
+               pct(queue, nr, 990), pct(queue, nr, 999));
+    }
+
+    free(total);
+    free(queue);
+    free(w);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,98 @@
+// mblog_follow.c - tail /dev/mblog with epoll instead of polling MBLOG_GET_SIZE
+//
+// The device is opened O_NONBLOCK with a low-water mark, so epoll_wait()
+// only returns once a batch of lowat bytes is pending. Each wake-up drains
+// everything with read() until EAGAIN and prints the records.
+// With a name the follower registers as a consumer: the driver then keeps
+// every record until this process has read it.
+//
+// Build: gcc -O2 -o mblog_follow mblog_follow.c
+// Usage: ./mblog_follow [lowat_bytes] [consumer_name]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include "mblog.h"
+
+#define DEVICE "/dev/mblog"  // Device file path
+
+int main(int argc, char *argv[])
+{
+    static char buf[64 * 1024];
+    struct epoll_event ev = { .events = EPOLLIN };
+    unsigned long wakeups = 0, records = 0;
+    __u32 lowat = 4096;
+    int follow = 1, format = MBLOG_FMT_RECORD;
+    int fd, ep;
+    ssize_t n, off;
+
+    if (argc > 1)
+        lowat = atoi(argv[1]);
+
+    fd = open(DEVICE, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        perror("open " DEVICE);
+        return 1;
+    }
+
+    if (ioctl(fd, MBLOG_SET_FOLLOW, &follow) < 0 ||
+        ioctl(fd, MBLOG_SET_LOWAT, &lowat) < 0 ||
+        ioctl(fd, MBLOG_SET_FORMAT, &format) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+
+    if (argc > 2) {
+        struct mblog_consumer_reg reg = { 0 };
+
+        strncpy(reg.name, argv[2], sizeof(reg.name) - 1);
+        if (ioctl(fd, MBLOG_REGISTER, &reg) < 0) {
+            perror("MBLOG_REGISTER");
+            return 1;
+        }
+        printf("registered as consumer \"%s\"\n", reg.name);
+    }
+
+    ep = epoll_create1(0);
+    ev.data.fd = fd;
+    if (ep < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll");
+        return 1;
+    }
+
+    printf("following " DEVICE " (wake every %u bytes)\n", lowat);
+    for (;;) {
+        if (epoll_wait(ep, &ev, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+        wakeups++;
+
+        // Drain the whole batch
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            for (off = 0; off < n; ) {
+                struct mblog_rec *rec = (struct mblog_rec *)(buf + off);
+
+                printf("[cpu%u pid %u] %.*s", rec->cpu, rec->pid, (int)rec->len,
+                       (char *)(rec + 1));
+                off += MBLOG_REC_SIZE(rec->len);
+                records++;
+            }
+        }
+        if (n < 0 && errno != EAGAIN) {
+            perror("read");
+            break;
+        }
+        fprintf(stderr, "wakeups=%lu records=%lu\n", wakeups, records);
+    }
+
+    close(ep);
+    close(fd);
+    return 0;
+}
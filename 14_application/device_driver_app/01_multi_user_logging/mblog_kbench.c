@@ -0,0 +1,182 @@
+// mblog_kbench.c - throughput of mblog_write_kernel() from N kernel threads at once
+//
+// insmod mblog_kbench.ko [threads=N] [duration_ms=2000] [len=64] [atomic=0]
+// One kthread is bound to each of the first N online CPUs and calls
+// mblog_write_kernel() (or mblog_write_kernel_atomic() with atomic=1) until
+// the run ends. Every 16th call is timed. The result is printed with pr_info
+// as one JSON line (ops_per_sec, p50/p99/p999 ns, drops), the same keys
+// mblog_bench prints for user space writers, so both can be compared by a script.
+// insmod returns once every thread has exited, so rmmod is safe right after.
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include "mblog_kernel.h"
+
+#define KBENCH_SAMPLE_EVERY 16
+#define KBENCH_MAX_SAMPLES  (1 << 16)   // per thread
+
+static int threads;
+module_param(threads, int, 0444);
+MODULE_PARM_DESC(threads, "Writer threads, one per CPU (0 = all online CPUs)");
+
+static int duration_ms = 2000;
+module_param(duration_ms, int, 0444);
+MODULE_PARM_DESC(duration_ms, "Length of the run in ms");
+
+static int len = 64;
+module_param(len, int, 0444);
+MODULE_PARM_DESC(len, "Payload bytes per record");
+
+static bool atomic;
+module_param(atomic, bool, 0444);
+MODULE_PARM_DESC(atomic, "Use mblog_write_kernel_atomic() instead of mblog_write_kernel()");
+
+struct kbench_worker {
+    struct task_struct *task;
+    u64 writes;             // records stored
+    u64 drops;              // records rejected (ring full or rate limited)
+    u32 *lat;               // sampled call latencies in ns
+    int nr_lat;
+};
+
+static char msg[256];
+static unsigned long deadline;  // jiffies at which the writers stop
+
+static int kbench_thread(void *arg)
+{
+    struct kbench_worker *w = arg;
+    unsigned long calls = 0;
+    bool ok;
+    u64 t0;
+
+    while (time_before(jiffies, deadline)) {
+        bool timed = calls++ % KBENCH_SAMPLE_EVERY == 0 && w->nr_lat < KBENCH_MAX_SAMPLES;
+
+        t0 = ktime_get_ns();
+        if (atomic)
+            ok = mblog_write_kernel_atomic(msg, len);
+        else
+            ok = mblog_write_kernel(msg, len) > 0;
+        if (timed)
+            w->lat[w->nr_lat++] = ktime_get_ns() - t0;
+
+        if (ok)
+            w->writes++;
+        else
+            w->drops++;
+
+        // The non-atomic API may run with preemption on: give other tasks a turn
+        if (!atomic && (calls & 1023) == 0)
+            cond_resched();
+    }
+
+    // Exit only through kthread_stop(): init must not return while we still run module code
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Percentile in units of 0.1% (500 = p50, 999 = p999) of n sorted samples
+static u32 pct(u32 *v, int n, int per_mille)
+{
+    return n ? v[div_u64((u64)(n - 1) * per_mille, 1000)] : 0;
+}
+
+static int __init mblog_kbench_init(void)
+{
+    struct kbench_worker *w;
+    u64 writes = 0, drops = 0, start, elapsed;
+    u32 *lat;
+    int nr_lat = 0, started = 0, cpu, i;
+
+    if (threads <= 0 || threads > num_online_cpus())
+        threads = num_online_cpus();
+    if (duration_ms <= 0 || len <= 0 || len > (int)sizeof(msg))
+        return -EINVAL;
+
+    w = kcalloc(threads, sizeof(*w), GFP_KERNEL);
+    lat = vmalloc(array_size(threads, KBENCH_MAX_SAMPLES * sizeof(*lat)));
+    if (!w || !lat) {
+        kfree(w);
+        vfree(lat);
+        return -ENOMEM;
+    }
+
+    memset(msg, 'k', len);
+    msg[len - 1] = '\n';
+
+    // Create and bind every thread first so they all start inside the same window
+    for_each_online_cpu(cpu) {
+        if (started == threads)
+            break;
+        w[started].lat = lat + (size_t)started * KBENCH_MAX_SAMPLES;
+        w[started].task = kthread_create(kbench_thread, &w[started], "mblog_kbench/%d", cpu);
+        if (IS_ERR(w[started].task))
+            break;
+        kthread_bind(w[started].task, cpu);
+        started++;
+    }
+
+    deadline = jiffies + msecs_to_jiffies(duration_ms);
+    start = ktime_get_ns();
+    for (i = 0; i < started; i++)
+        wake_up_process(w[i].task);
+
+    // Sleep through the run: a kthread_stop() before a thread got to run would
+    // keep it from ever calling kbench_thread(), and the CPU is theirs meanwhile
+    while (time_before(jiffies, deadline))
+        schedule_timeout_uninterruptible(deadline - jiffies);
+    elapsed = ktime_get_ns() - start;
+
+    for (i = 0; i < started; i++) {
+        // Waits for the thread to finish its last call and exit
+        kthread_stop(w[i].task);
+        writes += w[i].writes;
+        drops += w[i].drops;
+        // Pack the samples of all threads together before sorting
+        memmove(lat + nr_lat, w[i].lat, w[i].nr_lat * sizeof(*lat));
+        nr_lat += w[i].nr_lat;
+    }
+
+    sort(lat, nr_lat, sizeof(*lat), cmp_u32, NULL);
+    pr_info("{\"bench\":\"kernel_write\",\"api\":\"%s\",\"threads\":%d,\"line_size\":%d,"
+            "\"ops_per_sec\":%llu,\"p50_ns\":%u,\"p99_ns\":%u,\"p999_ns\":%u,\"drops\":%llu}\n",
+            atomic ? "atomic" : "normal", started, len,
+            div64_u64(writes * NSEC_PER_SEC, elapsed ?: 1),
+            pct(lat, nr_lat, 500), pct(lat, nr_lat, 990), pct(lat, nr_lat, 999), drops);
+
+    vfree(lat);
+    kfree(w);
+    return started ? 0 : -ENOMEM;
+}
+
+static void __exit mblog_kbench_exit(void)
+{
+}
+
+module_init(mblog_kbench_init);
+module_exit(mblog_kbench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Preethi");
+MODULE_DESCRIPTION("mblog multi-threaded kernel writer benchmark");
@@ -0,0 +1,24 @@
+// mblog_kernel.h - functions the mblog driver exports to other kernel modules
+#ifndef MBLOG_KERNEL_H
+#define MBLOG_KERNEL_H
+
+#include <linux/types.h>
+
+/*
+ * Append one record (source MBLOG_SRC_KERNEL) to the ring of the current CPU.
+ * Returns the number of bytes stored, -EINVAL for a NULL buffer,
+ * -ENOSPC if the ring is full in stop mode or -EAGAIN if the calling
+ * site is over its rate limit (MBLOG_SET_RATELIMIT, MBLOG_SRC_KERNEL).
+ */
+ssize_t mblog_write_kernel(const char *kbuf, size_t len);
+
+/*
+ * Same as mblog_write_kernel() but for hot paths in any context (hard IRQ,
+ * softirq, timers, with spinlocks held): never sleeps, never allocates and
+ * never waits. If the record does not fit or the calling site is over its
+ * rate limit it is dropped and counted (see MBLOG_GET_DROPPED and
+ * MBLOG_GET_STATS). Returns true if the record was stored.
+ */
+bool mblog_write_kernel_atomic(const char *kbuf, size_t len);
+
+#endif
@@ -0,0 +1,131 @@
+// mblog_lat.c - per-call latency of mblog_write_kernel_atomic() from process and hard IRQ context
+//
+// insmod mblog_lat.ko [samples=100000] [len=64] [batch=64]
+// The results (min/p50/p90/p99/p999/max in ns and dropped records) are printed
+// with pr_info; the module stays loaded so it can be inserted again after rmmod.
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/completion.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/math64.h>
+#include <linux/string.h>
+#include "mblog_kernel.h"
+
+static int samples = 100000;
+module_param(samples, int, 0444);
+MODULE_PARM_DESC(samples, "Calls measured in each context");
+
+static int len = 64;
+module_param(len, int, 0444);
+MODULE_PARM_DESC(len, "Payload bytes per record");
+
+static int batch = 64;
+module_param(batch, int, 0444);
+MODULE_PARM_DESC(batch, "Calls per hrtimer interrupt");
+
+static char msg[256];
+static u32 *lat;            // one latency sample (ns) per call
+static int nr_lat;
+static int nr_dropped;
+
+static struct hrtimer irq_timer;
+static DECLARE_COMPLETION(irq_done);
+
+// Time one logging call
+static void mblog_lat_one(void)
+{
+    u64 t0 = ktime_get_ns();
+
+    if (!mblog_write_kernel_atomic(msg, len))
+        nr_dropped++;
+    lat[nr_lat++] = ktime_get_ns() - t0;
+}
+
+// Runs in hard IRQ context: log a batch of records per tick until all samples are taken
+static enum hrtimer_restart mblog_lat_timer(struct hrtimer *t)
+{
+    int i;
+
+    for (i = 0; i < batch && nr_lat < samples; i++)
+        mblog_lat_one();
+
+    if (nr_lat >= samples) {
+        complete(&irq_done);
+        return HRTIMER_NORESTART;
+    }
+
+    hrtimer_forward_now(t, ns_to_ktime(100 * NSEC_PER_USEC));
+    return HRTIMER_RESTART;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Percentile in units of 0.01% (5000 = p50, 9990 = p999) of the sorted samples
+static u32 pct(int per_10k)
+{
+    return lat[div_u64((u64)(nr_lat - 1) * per_10k, 10000)];
+}
+
+static void mblog_lat_report(const char *ctx)
+{
+    sort(lat, nr_lat, sizeof(*lat), cmp_u32, NULL);
+
+    pr_info("mblog_lat: %-7s n=%d min=%u p50=%u p90=%u p99=%u p999=%u max=%u ns dropped=%d\n",
+            ctx, nr_lat, lat[0], pct(5000), pct(9000), pct(9900), pct(9990),
+            lat[nr_lat - 1], nr_dropped);
+}
+
+static int __init mblog_lat_init(void)
+{
+    int i;
+
+    if (samples <= 0 || len <= 0 || len > (int)sizeof(msg) || batch <= 0)
+        return -EINVAL;
+
+    lat = vmalloc(array_size(samples, sizeof(*lat)));
+    if (!lat)
+        return -ENOMEM;
+
+    memset(msg, 'x', len);
+    msg[len - 1] = '\n';
+
+    // Process context, preemption enabled
+    nr_lat = 0;
+    nr_dropped = 0;
+    for (i = 0; i < samples; i++)
+        mblog_lat_one();
+    mblog_lat_report("process");
+
+    // Hard IRQ context, from an hrtimer
+    nr_lat = 0;
+    nr_dropped = 0;
+    hrtimer_init(&irq_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+    irq_timer.function = mblog_lat_timer;
+    hrtimer_start(&irq_timer, ns_to_ktime(100 * NSEC_PER_USEC), HRTIMER_MODE_REL_HARD);
+    wait_for_completion(&irq_done);
+    mblog_lat_report("irq");
+
+    vfree(lat);
+    lat = NULL;
+    return 0;
+}
+
+static void __exit mblog_lat_exit(void)
+{
+    hrtimer_cancel(&irq_timer);
+}
+
+module_init(mblog_lat_init);
+module_exit(mblog_lat_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Preethi");
+MODULE_DESCRIPTION("mblog atomic logging latency benchmark");
@@ -0,0 +1,158 @@
+// mblog_mmap_bench.c - compare draining /dev/mblog with read() against the mmap() consumer
+//
+// Fills every CPU ring (stop mode, one pinned writer per CPU), then drains the
+// whole log repeatedly with both methods and prints payload MB/s and records/s.
+//
+// Build: gcc -O2 -pthread -o mblog_mmap_bench mblog_mmap_bench.c mblog_consumer.c
+// Usage: ./mblog_mmap_bench [iterations] [line_size]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include "mblog.h"
+#include "mblog_consumer.h"
+
+#define DEVICE "/dev/mblog"  // Device file path
+
+static int line_size = 100;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Write lines from one CPU until its ring reports ENOSPC
+static void *filler(void *arg)
+{
+    int cpu = (int)(long)arg;
+    char *line = malloc(line_size);
+    cpu_set_t set;
+    int fd;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    memset(line, 'a' + cpu % 26, line_size);
+    line[line_size - 1] = '\n';
+
+    fd = open(DEVICE, O_WRONLY);
+    if (fd >= 0) {
+        while (write(fd, line, line_size) >= 0)
+            ;
+        close(fd);
+    }
+    free(line);
+    return NULL;
+}
+
+static void fill_log(void)
+{
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *tids = calloc(ncpu, sizeof(*tids));
+    int mode = MBLOG_MODE_STOP, fd, i;
+
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open " DEVICE);
+        exit(1);
+    }
+    ioctl(fd, MBLOG_SET_MODE, &mode);
+    ioctl(fd, MBLOG_CLEAR);
+    close(fd);
+
+    for (i = 0; i < ncpu; i++)
+        pthread_create(&tids[i], NULL, filler, (void *)(long)i);
+    for (i = 0; i < ncpu; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+}
+
+static void bench_read(int iterations)
+{
+    static char buf[64 * 1024];
+    unsigned long long bytes = 0;
+    double start, elapsed;
+    ssize_t n;
+    int fd, i;
+
+    fd = open(DEVICE, O_RDONLY);
+    if (fd < 0) {
+        perror("open " DEVICE);
+        return;
+    }
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++) {
+        lseek(fd, 0, SEEK_SET);
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+            bytes += n;
+    }
+    elapsed = now_sec() - start;
+    close(fd);
+
+    printf("%-6s %12.1f MB/s %14.0f records/s\n", "read",
+           bytes / elapsed / 1e6, bytes / line_size / elapsed);
+}
+
+static void bench_mmap(int iterations)
+{
+    static char buf[64 * 1024];
+    struct mblog_consumer c;
+    struct mblog_rec hdr;
+    unsigned long long bytes = 0, records = 0;
+    double start, elapsed;
+    int n, i;
+
+    n = mblog_consumer_open(&c, DEVICE);
+    if (n < 0) {
+        fprintf(stderr, "mmap " DEVICE ": %s\n", strerror(-n));
+        return;
+    }
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++) {
+        mblog_consumer_rewind(&c);
+        while ((n = mblog_consumer_next(&c, &hdr, buf, sizeof(buf))) > 0) {
+            bytes += n;
+            records++;
+        }
+    }
+    elapsed = now_sec() - start;
+    mblog_consumer_close(&c);
+
+    printf("%-6s %12.1f MB/s %14.0f records/s\n", "mmap",
+           bytes / elapsed / 1e6, records / elapsed);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = 100;
+
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (argc > 2)
+        line_size = atoi(argv[2]);
+    if (iterations < 1)
+        iterations = 1;
+    if (line_size < 1)
+        line_size = 100;
+
+    fill_log();
+    printf("mblog drain benchmark: %d byte lines, %d passes over the full log\n",
+           line_size, iterations);
+
+    bench_read(iterations);
+    bench_mmap(iterations);
+    return 0;
+}
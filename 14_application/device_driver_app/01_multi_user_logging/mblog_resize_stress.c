@@ -0,0 +1,199 @@
+// mblog_resize_stress.c - resize the mblog rings over and over while every CPU writes
+//
+// One writer per CPU logs numbered, self-checking lines in overwrite mode.
+// A reader checks every record it gets: the payload must be intact and the
+// line numbers of each writer must only go up (lines lost to overwrite
+// are fine, lines seen twice or corrupted are not). Meanwhile the ring
+// size is cycled between small and large with MBLOG_SET_RING_SIZE.
+//
+// Build: gcc -O2 -pthread -o mblog_resize_stress mblog_resize_stress.c
+// Usage: ./mblog_resize_stress [seconds] [max_ring_kb]  (as root: resizing needs CAP_SYS_ADMIN)
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include "mblog.h"
+
+#define DEVICE "/dev/mblog"  // Device file path
+#define MAX_LINE 160
+
+static volatile int stop;
+static int ncpu;
+static unsigned long max_ring = 4096 * 1024;
+
+static unsigned long writes, resizes, busy;
+static unsigned long records, corrupt, reordered;
+
+// "<cpu> <n> " followed by one filler letter up to the newline; length depends on n
+static int make_line(char *buf, int cpu, unsigned long n)
+{
+    int len = 24 + n % (MAX_LINE - 24);
+    int off = snprintf(buf, len, "%03d %010lu ", cpu, n);
+
+    memset(buf + off, 'a' + n % 26, len - off - 1);
+    buf[len - 1] = '\n';
+    return len;
+}
+
+static void *writer(void *arg)
+{
+    int cpu = (int)(long)arg;
+    unsigned long n = 0, done = 0;
+    char line[MAX_LINE];
+    cpu_set_t set;
+    int fd, len;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    fd = open(DEVICE, O_WRONLY);
+    if (fd < 0) {
+        perror("open " DEVICE);
+        return NULL;
+    }
+
+    while (!stop) {
+        len = make_line(line, cpu, ++n);
+        if (write(fd, line, len) == len)
+            done++;
+    }
+    __atomic_add_fetch(&writes, done, __ATOMIC_RELAXED);
+    close(fd);
+    return NULL;
+}
+
+// Check one record against what make_line() would have written
+static void check_record(struct mblog_rec *rec, unsigned long *last)
+{
+    char *p = (char *)(rec + 1), expect[MAX_LINE];
+    unsigned long n;
+    int cpu;
+
+    records++;
+    if (sscanf(p, "%d %lu", &cpu, &n) != 2 || cpu < 0 || cpu >= ncpu ||
+        make_line(expect, cpu, n) != (int)rec->len || memcmp(p, expect, rec->len)) {
+        corrupt++;
+        return;
+    }
+    if (n <= last[cpu])
+        reordered++;
+    last[cpu] = n;
+}
+
+static void *reader(void *arg)
+{
+    static char buf[256 * 1024];
+    unsigned long *last = calloc(ncpu, sizeof(*last));
+    int format = MBLOG_FMT_RECORD, fd;
+    ssize_t n, off;
+
+    (void)arg;
+    fd = open(DEVICE, O_RDONLY);
+    if (fd < 0 || ioctl(fd, MBLOG_SET_FORMAT, &format) < 0) {
+        perror("reader");
+        return NULL;
+    }
+
+    while (!stop) {
+        n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            usleep(1000);
+            continue;
+        }
+        for (off = 0; off < n; ) {
+            struct mblog_rec *rec = (struct mblog_rec *)(buf + off);
+
+            check_record(rec, last);
+            off += MBLOG_REC_SIZE(rec->len);
+        }
+    }
+    free(last);
+    close(fd);
+    return NULL;
+}
+
+static void *resizer(void *arg)
+{
+    __u64 size;
+    unsigned long kb = 4;
+    int fd = open(DEVICE, O_RDONLY);
+
+    (void)arg;
+    if (fd < 0) {
+        perror("open " DEVICE);
+        return NULL;
+    }
+
+    // 4K, 8K ... max, then back down, and again
+    while (!stop) {
+        size = kb * 1024;
+        if (ioctl(fd, MBLOG_SET_RING_SIZE, &size) == 0)
+            resizes++;
+        else if (errno == EBUSY)
+            busy++;     // somebody has the rings mmap()ed
+        else
+            perror("MBLOG_SET_RING_SIZE");
+
+        kb = kb * 4 > max_ring / 1024 ? 4 : kb * 4;
+        usleep(2000);
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int seconds = 10, mode = MBLOG_MODE_OVERWRITE, fd, i;
+    pthread_t *tids, rd, rs;
+    __u64 size;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1)
+        seconds = atoi(argv[1]);
+    if (argc > 2)
+        max_ring = strtoul(argv[2], NULL, 0) * 1024;
+
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open " DEVICE);
+        return 1;
+    }
+    // Writers must never stop on a full ring
+    ioctl(fd, MBLOG_SET_MODE, &mode);
+    ioctl(fd, MBLOG_CLEAR);
+
+    printf("resizing up to %lu KB per CPU under %d writers for %d s\n",
+           max_ring / 1024, ncpu, seconds);
+
+    tids = calloc(ncpu, sizeof(*tids));
+    for (i = 0; i < ncpu; i++)
+        pthread_create(&tids[i], NULL, writer, (void *)(long)i);
+    pthread_create(&rd, NULL, reader, NULL);
+    pthread_create(&rs, NULL, resizer, NULL);
+
+    sleep(seconds);
+    stop = 1;
+
+    for (i = 0; i < ncpu; i++)
+        pthread_join(tids[i], NULL);
+    pthread_join(rd, NULL);
+    pthread_join(rs, NULL);
+    free(tids);
+
+    // Leave the default size behind
+    size = 4096;
+    ioctl(fd, MBLOG_SET_RING_SIZE, &size);
+    close(fd);
+
+    printf("writes %lu, resizes %lu (busy %lu), records checked %lu\n",
+           writes, resizes, busy, records);
+    printf("corrupt %lu, out of order %lu\n", corrupt, reordered);
+    return corrupt || reordered ? 1 : 0;
+}
@@ -5,190 +5,2516 @@
 #include <linux/device.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
-#include <linux/semaphore.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/list.h>
+#include <linux/string.h>
+#include <linux/rcupdate.h>
+#include <linux/smp.h>
+#include <linux/cpu.h>
+#include <linux/atomic.h>
+#include <linux/hash.h>
+#include <linux/capability.h>
+#include <linux/crypto.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/pid.h>
+#include <linux/pid_namespace.h>
+#include <linux/compat.h>
+#include "mblog.h"  // Contains IOCTL commands shared with user space
+#include "mblog_kernel.h"
 
 #define DEVICE_NAME "mblog"
 
-// IOCTL commands
-#define MBLOG_CLEAR     _IO('m', 1)             // Clear log buffer
-#define MBLOG_GET_SIZE  _IOR('m', 2, size_t)    // Get current log size
+// Most one write()/writev() call appends under a single reservation (one record per iovec)
+#define MBLOG_MAX_BATCH_RECS   UIO_MAXIOV
+#define MBLOG_MAX_BATCH_BYTES  (64 * 1024)
 
-// Default log buffer size (can be changed using module_param while inserting module)
+// Size of each CPU ring (set while inserting the module, later with MBLOG_SET_RING_SIZE)
 static int bufsize = 4096;
-module_param(bufsize, int, 0644);
-MODULE_PARM_DESC(bufsize, "Initial log buffer size");
+module_param(bufsize, int, 0444);
+MODULE_PARM_DESC(bufsize, "Log ring size per CPU (rounded up to a power of two)");
+
+// Largest ring MBLOG_SET_RING_SIZE accepts, per CPU
+#define MBLOG_MAX_RING_SIZE    (512UL << 20)
+
+// Compressed history of each CPU ring (see "Cold segments" below), 0 disables it
+static int cold_kb;
+module_param(cold_kb, int, 0444);
+MODULE_PARM_DESC(cold_kb, "Compressed history kept per CPU in KB, 0 = off");
+
+static char *cold_alg = "lz4";
+module_param(cold_alg, charp, 0444);
+MODULE_PARM_DESC(cold_alg, "Crypto API compressor for cold segments (lz4, zstd, ...)");
+
+// Largest sealed segment; rings smaller than twice this seal half a ring at a time
+#define MBLOG_SEG_SIZE      (64 * 1024)
+
+// Spill to a file (see "Spill" below), also settable at runtime in sysfs spill/path
+static char *spill_path;
+module_param(spill_path, charp, 0444);
+MODULE_PARM_DESC(spill_path, "File the spill thread appends every record to (default: off)");
+
+static int spill_batch_kb = 1024;
+module_param(spill_batch_kb, int, 0444);
+MODULE_PARM_DESC(spill_batch_kb, "Bytes gathered per spill file write, in KB");
+
+// Writers tracked one by one; later ones share an "other" source per type
+#define MBLOG_SOURCE_BITS   9
+#define MBLOG_NR_SOURCES    (1 << MBLOG_SOURCE_BITS)
+#define MBLOG_SOURCE_PROBE  8
+
+// Full ring behaviour, can also be switched at runtime with MBLOG_SET_MODE
+static bool overwrite;
+module_param(overwrite, bool, 0644);
+MODULE_PARM_DESC(overwrite, "Drop the oldest records instead of failing with -ENOSPC when full");
 
 // Device related variables
 static dev_t dev_no;
 static struct cdev mblog_cdev;
 static struct class *mblog_class;
 
-// Log buffer variables
-static char *log_buffer;
-static size_t log_len;
+/*
+ * Storage of one ring. MBLOG_SET_RING_SIZE swaps it for a new one, so
+ * readers find it through RCU; the bytes at a ring position are the same
+ * in the old and the new buffer until tail moves past them.
+ */
+struct mblog_buf {
+    size_t size;                    // power of two
+    char *data;                     // vmalloc_user() pages, mapped read-only by mmap()
+};
+
+/*
+ * One ring per CPU (record format is in mblog.h). Readers merge the rings
+ * by timestamp. head and tail live in the mmap()able control area so
+ * user space can follow the log without syscalls.
+ * Only the owning CPU moves head, with local interrupts disabled,
+ * so writers never share a lock or a cache line with other CPUs.
+ * tail only moves forward, with cmpxchg(), because the owner
+ * (overwrite mode), MBLOG_CLEAR and consumer reclaim can all advance it.
+ */
+struct mblog_ring {
+    struct mblog_buf __rcu *buf;    // only replaced on the owning CPU, with interrupts off
+    struct mblog_ring_ctl *ctl;     // head/tail of this ring inside mblog_hdr
+    u64 seq;                        // sequence number of the next record
+    u64 dropped;                    // records rejected because the ring was full
+    struct list_head cold;          // sealed segments, oldest first (mblog_cold_lock)
+    size_t cold_bytes;              // compressed bytes on the list
+    unsigned long sealed;           // everything before this is in a segment (seal worker)
+};
+
+static DEFINE_PER_CPU(struct mblog_ring, mblog_rings);
+static size_t ring_size;        // size of every ring buffer once no resize is running
+
+// Serializes ring resizing against each other and mmap(); no resize while the rings are mapped
+static DEFINE_MUTEX(mblog_resize_lock);
+static atomic_t mblog_maps;
+
+// Control area shared with user space, followed in the mapping by the rings
+static struct mblog_mmap_hdr *mblog_hdr;
+static size_t ctl_size;
+
+// Per open file read state: one cursor per CPU ring plus the record being copied out
+struct mblog_reader {
+    struct mutex lock;          // serializes read() calls sharing this file
+    struct list_head node;      // on mblog_consumers once registered
+    bool consumer;              // registered with MBLOG_REGISTER
+    u32 id;
+    pid_t pid;
+    char name[MBLOG_NAME_LEN];
+    int format;                 // MBLOG_FMT_TEXT or MBLOG_FMT_RECORD
+    bool follow;                // read() waits for new data instead of returning EOF
+    u32 lowat;                  // bytes that must be pending before a waiter wakes
+    struct mblog_rec hdr;       // header of the record in rec[]
+    size_t pend_len;            // payload bytes of rec[] still to hand out
+    size_t pend_off;
+    struct mblog_seq_info seq_info;
+    u64 *next_seq;              // expected sequence number per CPU
+    struct mblog_cold_view **cold;  // per CPU, allocated when history is read
+    char rec[MBLOG_MAX_RECORD];
+    unsigned long pos[];        // nr_cpu_ids cursors
+};
+
+// next_seq value after a rewind, the first record read only sets the expectation
+#define MBLOG_SEQ_UNKNOWN U64_MAX
+
+/*
+ * Registered consumers. Ring space is only reclaimed (tail moved) up to
+ * the smallest cursor among them, see mblog_reclaim(). Lock order:
+ * mblog_consumers_lock, then a reader's lock.
+ */
+static LIST_HEAD(mblog_consumers);
+static DEFINE_MUTEX(mblog_consumers_lock);
+static u32 mblog_next_consumer_id = 1;
+
+/*
+ * Readers blocked in read()/poll() sleep on mblog_wait. To wake them once per
+ * batch instead of once per record, writers (only when somebody sleeps) add
+ * their bytes to mblog_pending and wake everybody once it reaches
+ * mblog_wake_lowat, the smallest amount any sleeper still needs. Woken
+ * readers that are still below their low-water mark re-arm it.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(mblog_wait);
+static atomic_long_t mblog_pending;
+static unsigned long mblog_wake_lowat = ULONG_MAX;     // protected by mblog_wait.lock
+
+/*
+ * Cold segments. With cold_kb set, a worker seals each ring in fixed size
+ * segments once they fill up: it copies the records out like a reader,
+ * compresses them with the crypto API and moves tail past them, so the
+ * ring has room again. Readers whose cursor is behind tail find those
+ * records in the segments and decompress them on the fly; ring positions
+ * are unchanged, so this is invisible to them. The oldest segments are
+ * freed when a CPU holds more than cold_kb of compressed data.
+ * Writers only queue the worker when a segment is full.
+ */
+struct mblog_seg {
+    struct list_head node;
+    unsigned long start, end;   // ring positions held, on record boundaries
+    u32 clen;                   // bytes in data[]
+    bool raw;                   // stored as is, it did not compress
+    u8 data[];
+};
+
+// Decompressed copy of one segment per CPU, cached by each reader of history
+struct mblog_cold_view {
+    unsigned long start, end;
+    unsigned int gen;           // mblog_cold_gen when decompressed
+    char data[MBLOG_SEG_SIZE];
+};
+
+static bool mblog_cold;                     // sealing is running
+static DEFINE_MUTEX(mblog_cold_lock);       // segment lists and mblog_decomp_tfm
+static atomic_t mblog_cold_gen;             // bumped by MBLOG_CLEAR, invalidates views
+static struct crypto_comp *mblog_comp_tfm;  // seal worker only
+static struct crypto_comp *mblog_decomp_tfm;
+static struct workqueue_struct *mblog_cold_wq;
+static char *mblog_seal_buf, *mblog_comp_buf;
+
+// Totals for sysfs cold/
+static u64 mblog_cold_segments, mblog_cold_stored, mblog_cold_raw, mblog_cold_lost;
+
+static void mblog_seal_work_fn(struct work_struct *work);
+static DECLARE_WORK(mblog_seal_work, mblog_seal_work_fn);
+
+/*
+ * Per writer accounting and rate limiting. The table is allocated once
+ * and entries are claimed with cmpxchg() on key (a tgid for user writers,
+ * the caller address for kernel ones), so the write path takes no lock.
+ * A user entry also records when its process started: once that process
+ * is gone, the entry is recycled for the next process probing past it,
+ * or for a new process that got the same pid, so neither a full table
+ * nor a reused pid hands one process's limit and counters to another.
+ * Kernel entries stay for the module's life. Token buckets are plain
+ * atomics: a refill is done by whoever wins the cmpxchg() on last,
+ * everybody else just takes tokens.
+ */
+struct mblog_source {
+    unsigned long key;          // 0: free slot
+    u16 type;                   // MBLOG_SRC_*
+    u64 stamp;                  // user: start_time of the thread group leader
+    u64 rate, burst;            // per process limit, 0: use the type default
+    atomic64_t tokens;          // bytes that may still be written
+    atomic64_t last;            // ktime_get_ns() of the last refill
+    atomic64_t accepted, throttled, dropped;
+} ____cacheline_aligned_in_smp;
+
+static struct mblog_source *mblog_sources;
+static struct mblog_source mblog_other[2];     // overflow, indexed by type
+
+// Default limits per type (MBLOG_SRC_USER, MBLOG_SRC_KERNEL), 0 = unlimited
+static u64 mblog_rate[2], mblog_burst[2];
+
+// Wrap safe "a comes before b" for ring positions
+static inline bool pos_before(unsigned long a, unsigned long b)
+{
+    return (long)(a - b) < 0;
+}
+
+static void ring_copy_in(struct mblog_buf *b, unsigned long pos, const void *src, size_t len)
+{
+    size_t off = pos & (b->size - 1);
+    size_t first = min(len, b->size - off);
+
+    memcpy(b->data + off, src, first);
+    memcpy(b->data, (const char *)src + first, len - first);
+}
+
+static void ring_copy_out(const struct mblog_buf *b, unsigned long pos, void *dst, size_t len)
+{
+    size_t off = pos & (b->size - 1);
+    size_t first = min(len, b->size - off);
+
+    memcpy(dst, b->data + off, first);
+    memcpy((char *)dst + first, b->data, len - first);
+}
+
+/*
+ * Move tail forward to new_tail unless somebody already moved it further.
+ * Returns the tail value that is current afterwards.
+ */
+static unsigned long ring_advance_tail(struct mblog_ring *r, unsigned long tail,
+                                       unsigned long new_tail)
+{
+    unsigned long prev;
+
+    while (pos_before(tail, new_tail)) {
+        prev = cmpxchg(&r->ctl->tail, tail, new_tail);
+        if (prev == tail)
+            return new_tail;
+        tail = prev;
+    }
+    return tail;
+}
+
+// Called by writers after a record is published
+static void mblog_wake_readers(size_t bytes)
+{
+    unsigned long flags;
+
+    // Full barrier: either we see the sleeper or it sees our new head
+    if (!wq_has_sleeper(&mblog_wait))
+        return;
+
+    if ((unsigned long)atomic_long_add_return(bytes, &mblog_pending) <
+        READ_ONCE(mblog_wake_lowat))
+        return;
+
+    spin_lock_irqsave(&mblog_wait.lock, flags);
+    atomic_long_set(&mblog_pending, 0);
+    mblog_wake_lowat = ULONG_MAX;
+    wake_up_locked_poll(&mblog_wait, EPOLLIN | EPOLLRDNORM);
+    spin_unlock_irqrestore(&mblog_wait.lock, flags);
+}
+
+/*
+ * Give the user entry s to a new process started at stamp. Its counters
+ * go to the shared "other" entry, so the totals never go down; a write
+ * racing with this may be counted on either side.
+ */
+static void mblog_source_recycle(struct mblog_source *s, u64 stamp)
+{
+    struct mblog_source *o = &mblog_other[MBLOG_SRC_USER];
+
+    WRITE_ONCE(s->rate, 0);
+    WRITE_ONCE(s->burst, 0);
+    atomic64_set(&s->tokens, 0);
+    atomic64_set(&s->last, 0);      // the first write refills from the default
+    atomic64_add(atomic64_xchg(&s->accepted, 0), &o->accepted);
+    atomic64_add(atomic64_xchg(&s->throttled, 0), &o->throttled);
+    atomic64_add(atomic64_xchg(&s->dropped, 0), &o->dropped);
+    WRITE_ONCE(s->stamp, stamp);
+}
+
+// The process user entry s was claimed for (tgid key) has exited
+static bool mblog_source_stale(struct mblog_source *s, unsigned long key)
+{
+    struct task_struct *t;
+    bool stale;
+
+    if (READ_ONCE(s->type) != MBLOG_SRC_USER)
+        return false;
+
+    rcu_read_lock();
+    t = pid_task(find_pid_ns(key, &init_pid_ns), PIDTYPE_TGID);
+    stale = !t || t->start_time != READ_ONCE(s->stamp);
+    rcu_read_unlock();
+    return stale;
+}
+
+/*
+ * Find or claim the source of key, falling back to the shared one of its
+ * type. stamp tells user processes with the same tgid apart (0 for kernel
+ * sources).
+ */
+static struct mblog_source *mblog_get_source(unsigned long key, u64 stamp, u16 type)
+{
+    struct mblog_source *s;
+    unsigned long cur;
+    u64 old;
+    u32 i, h = hash_long(key, MBLOG_SOURCE_BITS);
+
+    for (i = 0; i < MBLOG_SOURCE_PROBE; i++) {
+        s = &mblog_sources[(h + i) & (MBLOG_NR_SOURCES - 1)];
+        cur = READ_ONCE(s->key);
+        if (!cur) {
+            cur = cmpxchg(&s->key, 0, key);
+            if (!cur) {
+                WRITE_ONCE(s->stamp, stamp);
+                WRITE_ONCE(s->type, type);
+                return s;
+            }
+        }
+        if (cur == key) {
+            // Same tgid, other process: the pid was reused, start the entry over
+            old = READ_ONCE(s->stamp);
+            if (old != stamp && cmpxchg64(&s->stamp, old, stamp) == old)
+                mblog_source_recycle(s, stamp);
+            return s;
+        }
+    }
+
+    /*
+     * No match and no free entry: take over one whose process has exited.
+     * Only processes that would land in "other" pay for these pid lookups,
+     * and only the winner of the cmpxchg() recycles the entry.
+     */
+    if (type == MBLOG_SRC_USER) {
+        for (i = 0; i < MBLOG_SOURCE_PROBE; i++) {
+            s = &mblog_sources[(h + i) & (MBLOG_NR_SOURCES - 1)];
+            cur = READ_ONCE(s->key);
+            if (mblog_source_stale(s, cur) && cmpxchg(&s->key, cur, key) == cur) {
+                mblog_source_recycle(s, stamp);
+                return s;
+            }
+        }
+    }
+    return &mblog_other[type];
+}
+
+static struct mblog_source *mblog_user_source(void)
+{
+    return mblog_get_source(task_tgid_nr(current), current->group_leader->start_time,
+                            MBLOG_SRC_USER);
+}
+
+/*
+ * Take bytes tokens from the bucket of s. Refills at most once per
+ * millisecond, by rate * elapsed time, up to burst.
+ */
+static bool mblog_rate_ok(struct mblog_source *s, size_t bytes)
+{
+    u64 rate = READ_ONCE(s->rate), burst = READ_ONCE(s->burst);
+    u64 now, last, dt;
+
+    if (!rate) {
+        rate = READ_ONCE(mblog_rate[s->type]);
+        burst = READ_ONCE(mblog_burst[s->type]);
+    }
+    if (!rate)
+        return true;    // unlimited, the common case
+
+    now = ktime_get_ns();
+    last = atomic64_read(&s->last);
+    dt = now - last;
+    if (dt >= NSEC_PER_MSEC && atomic64_cmpxchg(&s->last, last, now) == last) {
+        // Buckets never hold more than one second of rate, so one second of refill is enough
+        dt = min_t(u64, dt, NSEC_PER_SEC);
+        // Signed: a bucket taken below zero by a racing writer is not "over burst"
+        if (atomic64_add_return(div_u64(rate * dt, NSEC_PER_SEC), &s->tokens) > (s64)burst)
+            atomic64_set(&s->tokens, burst);
+    }
+
+    if (atomic64_sub_return(bytes, &s->tokens) >= 0)
+        return true;
+    atomic64_add(bytes, &s->tokens);
+    return false;
+}
+
+// Segment size for the current ring size
+static size_t mblog_seg_size(void)
+{
+    return min_t(size_t, MBLOG_SEG_SIZE, READ_ONCE(ring_size) / 2);
+}
+
+/*
+ * Append nrec records (payloads packed back to back in kbuf, lengths in
+ * lens[], each 1..MBLOG_MAX_RECORD) to the current CPU ring under one
+ * reservation: they are published together, with consecutive sequence
+ * numbers. Batches larger than the whole ring fail with -ENOSPC, and
+ * batches over the rate limit of src with -EAGAIN.
+ * Safe from any context: it does not sleep, allocate or wait for other CPUs.
+ */
+static ssize_t mblog_append_batch(const char *kbuf, const u32 *lens, int nrec, u16 source,
+                                  struct mblog_source *src)
+{
+    struct mblog_ring *r;
+    struct mblog_buf *b;
+    struct mblog_rec hdr, old;
+    unsigned long flags, head, tail, pos;
+    size_t need = 0, bytes = 0;
+    int i;
+
+    for (i = 0; i < nrec; i++) {
+        need += MBLOG_REC_SIZE(lens[i]);
+        bytes += lens[i];
+    }
+    if (!bytes)
+        return 0;
+
+    if (!mblog_rate_ok(src, bytes)) {
+        atomic64_add(bytes, &src->throttled);
+        return -EAGAIN;
+    }
+
+    // Interrupts off: nothing else can touch this CPU ring until we publish head
+    local_irq_save(flags);
+    r = this_cpu_ptr(&mblog_rings);
+    b = rcu_dereference_sched(r->buf);  // stable: a resize swaps it from an IPI on this CPU
+    head = r->ctl->head;
+
+    // acquire pairs with MBLOG_CLEAR: old bytes are only reused after the new tail is seen
+    tail = smp_load_acquire(&r->ctl->tail);
+    while (need > b->size - (head - tail)) {
+        // Overwriting cannot help a batch bigger than the ring (it was just shrunk)
+        if (!READ_ONCE(overwrite) || need > b->size) {
+            r->dropped += nrec;
+            local_irq_restore(flags);
+            atomic64_add(bytes, &src->dropped);
+            return -ENOSPC; // No space left
+        }
+
+        // Drop the oldest record; the cmpxchg orders the new tail before we reuse its bytes
+        ring_copy_out(b, tail, &old, sizeof(old));
+        tail = ring_advance_tail(r, tail, tail + MBLOG_REC_SIZE(old.len));
+    }
+
+    hdr.pid = in_task() ? task_tgid_nr(current) : 0;
+    hdr.ts = ktime_get_ns();    // CLOCK_MONOTONIC
+    hdr.cpu = smp_processor_id();
+    hdr.source = source;
+    hdr.pad = 0;
+
+    for (i = 0, pos = head; i < nrec; i++) {
+        hdr.len = lens[i];
+        hdr.seq = r->seq++;
+        ring_copy_in(b, pos, &hdr, sizeof(hdr));
+        ring_copy_in(b, pos + sizeof(hdr), kbuf, lens[i]);
+        kbuf += lens[i];
+        pos += MBLOG_REC_SIZE(lens[i]);
+    }
+
+    // Make the records visible to readers
+    smp_store_release(&r->ctl->head, head + need);
+    local_irq_restore(flags);
+
+    mblog_wake_readers(need);
+    atomic64_add(bytes, &src->accepted);
+
+    // A full segment is waiting to be sealed (re-queueing a pending work is a bit test)
+    if (mblog_cold && head + need - READ_ONCE(r->sealed) >= mblog_seg_size())
+        queue_work(mblog_cold_wq, &mblog_seal_work);
+    return bytes;
+}
+
+// Append one record, cut to MBLOG_MAX_RECORD
+static ssize_t mblog_append(const char *kbuf, size_t len, u16 source,
+                            struct mblog_source *src)
+{
+    u32 rec_len = min_t(size_t, len, MBLOG_MAX_RECORD);
+
+    // nothing to log, and empty records would look like "no record"
+    if (!rec_len)
+        return 0;
+
+    return mblog_append_batch(kbuf, &rec_len, 1, source, src);
+}
+
+/*
+ * Read the header at *pos of one ring. Skips forward if the data was
+ * cleared or overwritten under the cursor, or returns -EAGAIN instead with
+ * cold set (the records may be in a cold segment). Returns 0 when the ring
+ * has nothing new, 1 with the header. Called under rcu_read_lock().
+ */
+static int mblog_peek(struct mblog_ring *r, unsigned long *pos, struct mblog_rec *hdr, bool cold)
+{
+    unsigned long head, tail;
+
+    for (;;) {
+        head = smp_load_acquire(&r->ctl->head);
+        tail = READ_ONCE(r->ctl->tail);
+        if (pos_before(*pos, tail)) {
+            if (cold)
+                return -EAGAIN;
+            *pos = tail;
+        }
+        if (*pos == head)
+            return 0;
+
+        // Loaded after head: a buffer swapped in before head was published is seen
+        ring_copy_out(rcu_dereference(r->buf), *pos, hdr, sizeof(*hdr));
+
+        // Header is only valid if the bytes were not released while we copied them
+        smp_rmb();
+        if (!pos_before(*pos, READ_ONCE(r->ctl->tail)) && hdr->len <= MBLOG_MAX_RECORD)
+            return 1;
+    }
+}
+
+/*
+ * Cursor behind tail: serve it from the cold segments of the ring.
+ * Returns true with the header of the record at rd->pos[cpu] (payload in
+ * rd->cold[cpu]); false once the cursor was moved up to tail because the
+ * history before it is gone.
+ */
+static bool mblog_cold_peek(struct mblog_reader *rd, int cpu, struct mblog_rec *hdr)
+{
+    struct mblog_ring *r = per_cpu_ptr(&mblog_rings, cpu);
+    struct mblog_cold_view *v = rd->cold[cpu];
+    struct mblog_seg *seg, *found;
+    unsigned long pos = rd->pos[cpu], tail;
+    unsigned int dlen;
+    int ret;
+
+    if (v && v->gen == atomic_read(&mblog_cold_gen) &&
+        !pos_before(pos, v->start) && pos_before(pos, v->end))
+        goto hit;
+
+    if (!v) {
+        v = kvmalloc(sizeof(*v), GFP_KERNEL);
+        if (!v)
+            goto skip;
+        rd->cold[cpu] = v;
+    }
+
+    mutex_lock(&mblog_cold_lock);
+    for (;;) {
+        found = NULL;
+        list_for_each_entry(seg, &r->cold, node) {
+            if (pos_before(pos, seg->end)) {
+                found = seg;
+                break;
+            }
+        }
+        if (!found)
+            break;
+        // Records before the oldest segment were evicted (or never sealed)
+        if (pos_before(pos, found->start))
+            pos = found->start;
+
+        dlen = sizeof(v->data);
+        if (found->raw) {
+            memcpy(v->data, found->data, found->clen);
+            dlen = found->clen;
+            ret = 0;
+        } else {
+            ret = crypto_comp_decompress(mblog_decomp_tfm, found->data, found->clen,
+                                         (u8 *)v->data, &dlen);
+        }
+        if (!ret && dlen == found->end - found->start) {
+            v->start = found->start;
+            v->end = found->end;
+            v->gen = atomic_read(&mblog_cold_gen);
+            break;
+        }
+        pos = found->end;   // corrupt segment, skip it
+    }
+    mutex_unlock(&mblog_cold_lock);
+
+    if (!found)
+        goto skip;
+    rd->pos[cpu] = pos;
+hit:
+    memcpy(hdr, v->data + (pos - v->start), sizeof(*hdr));
+    return true;
+
+skip:
+    tail = READ_ONCE(r->ctl->tail);
+    if (pos_before(pos, tail))
+        pos = tail;
+    rd->pos[cpu] = pos;
+    return false;
+}
+
+enum { MBLOG_PEEK_NONE, MBLOG_PEEK_HOT, MBLOG_PEEK_COLD };
+
+// Header of the next record of one CPU for this reader, from the ring or its cold segments
+static int mblog_peek_cpu(struct mblog_reader *rd, int cpu, struct mblog_rec *hdr)
+{
+    struct mblog_ring *r = per_cpu_ptr(&mblog_rings, cpu);
+    int ret;
+
+    for (;;) {
+        if (mblog_cold && pos_before(rd->pos[cpu], READ_ONCE(r->ctl->tail)) &&
+            mblog_cold_peek(rd, cpu, hdr))
+            return MBLOG_PEEK_COLD;
+
+        // The ring buffer may be swapped by a resize, keep the one we copy from alive
+        rcu_read_lock();
+        ret = mblog_peek(r, &rd->pos[cpu], hdr, mblog_cold);
+        rcu_read_unlock();
+        if (ret >= 0)
+            return ret ? MBLOG_PEEK_HOT : MBLOG_PEEK_NONE;
+        // The records were sealed while we looked, go get them from the segment
+    }
+}
+
+// Pull the oldest record over all CPU rings into rd->rec
+static bool mblog_next_record(struct mblog_reader *rd)
+{
+    struct mblog_ring *r;
+    struct mblog_cold_view *v;
+    struct mblog_rec hdr, best_hdr;
+    unsigned long pos;
+    int cpu, best, kind, best_kind = MBLOG_PEEK_NONE;
+
+    for (;;) {
+        best = -1;
+        for_each_possible_cpu(cpu) {
+            kind = mblog_peek_cpu(rd, cpu, &hdr);
+            if (kind == MBLOG_PEEK_NONE)
+                continue;
+            if (best < 0 || hdr.ts < best_hdr.ts) {
+                best = cpu;
+                best_hdr = hdr;
+                best_kind = kind;
+            }
+        }
+
+        if (best < 0)
+            return false;
+
+        pos = rd->pos[best];
+        if (best_kind == MBLOG_PEEK_COLD) {
+            // Segments never change, the copy in our view is stable
+            v = rd->cold[best];
+            memcpy(rd->rec, v->data + (pos - v->start) + sizeof(best_hdr), best_hdr.len);
+        } else {
+            r = per_cpu_ptr(&mblog_rings, best);
+            rcu_read_lock();
+            ring_copy_out(rcu_dereference(r->buf), pos + sizeof(best_hdr), rd->rec,
+                          best_hdr.len);
+            rcu_read_unlock();
+
+            smp_rmb();
+            if (pos_before(pos, READ_ONCE(r->ctl->tail)))
+                continue;   // cleared, overwritten or sealed while copying, pick again
+        }
+
+        // A gap in the sequence numbers is what this reader lost to overwrite/clear
+        if (rd->next_seq[best] != MBLOG_SEQ_UNKNOWN && best_hdr.seq > rd->next_seq[best])
+            rd->seq_info.missed += best_hdr.seq - rd->next_seq[best];
+        rd->next_seq[best] = best_hdr.seq + 1;
+        rd->seq_info.records++;
+
+        // release: mblog_reclaim() may free these bytes as soon as it sees the new cursor
+        smp_store_release(&rd->pos[best], pos + MBLOG_REC_SIZE(best_hdr.len));
+        rd->hdr = best_hdr;
+        rd->pend_len = best_hdr.len;
+        rd->pend_off = 0;
+        return true;
+    }
+}
+
+// Oldest ring position of one CPU still held, in a cold segment or in the ring
+static unsigned long mblog_oldest(int cpu)
+{
+    struct mblog_ring *r = per_cpu_ptr(&mblog_rings, cpu);
+    unsigned long pos = READ_ONCE(r->ctl->tail);
+
+    if (mblog_cold) {
+        mutex_lock(&mblog_cold_lock);
+        if (!list_empty(&r->cold))
+            pos = list_first_entry(&r->cold, struct mblog_seg, node)->start;
+        mutex_unlock(&mblog_cold_lock);
+    }
+    return pos;
+}
+
+// Move every cursor of this reader to the oldest data still held
+static void mblog_rewind(struct mblog_reader *rd)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        rd->pos[cpu] = mblog_oldest(cpu);
+        rd->next_seq[cpu] = MBLOG_SEQ_UNKNOWN;
+    }
+    rd->pend_len = 0;
+    rd->pend_off = 0;
+}
+
+/*
+ * Smallest cursor of the registered consumers on one CPU, or limit if that
+ * is smaller. Called with mblog_consumers_lock held.
+ */
+static unsigned long mblog_consumers_min(int cpu, unsigned long limit)
+{
+    unsigned long tail = READ_ONCE(per_cpu_ptr(&mblog_rings, cpu)->ctl->tail);
+    struct mblog_reader *rd;
+    unsigned long pos;
+
+    list_for_each_entry(rd, &mblog_consumers, node) {
+        // acquire pairs with mblog_next_record(): the consumer is done copying
+        pos = smp_load_acquire(&rd->pos[cpu]);
+        if (pos_before(pos, tail))
+            pos = tail;     // its old records were overwritten or cleared already
+        if (pos_before(pos, limit))
+            limit = pos;
+    }
+    return limit;
+}
+
+/*
+ * Move the tail of every ring up to the slowest registered consumer, so
+ * writers in stop mode get the space back. Without consumers nothing is
+ * reclaimed here; the log is then only emptied by MBLOG_CLEAR.
+ */
+static void mblog_reclaim(void)
+{
+    struct mblog_ring *r;
+    int cpu;
+
+    mutex_lock(&mblog_consumers_lock);
+    if (list_empty(&mblog_consumers))
+        goto out;
+
+    for_each_possible_cpu(cpu) {
+        r = per_cpu_ptr(&mblog_rings, cpu);
+        ring_advance_tail(r, READ_ONCE(r->ctl->tail),
+                          mblog_consumers_min(cpu, smp_load_acquire(&r->ctl->head)));
+    }
+out:
+    mutex_unlock(&mblog_consumers_lock);
+}
+
+// Bytes this reader has not consumed yet, headers included
+static size_t mblog_avail(struct mblog_reader *rd)
+{
+    struct mblog_ring *r;
+    unsigned long head, tail, pos;
+    size_t total = rd->pend_len - rd->pend_off;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        r = per_cpu_ptr(&mblog_rings, cpu);
+        head = smp_load_acquire(&r->ctl->head);
+        tail = READ_ONCE(r->ctl->tail);
+        pos = READ_ONCE(rd->pos[cpu]);
+        total += head - (pos_before(pos, tail) ? tail : pos);
+    }
+    return total;
+}
+
+/*
+ * Returns true if the reader already has lowat bytes. Otherwise lowers the
+ * global wake threshold to what this reader still needs. Must be called
+ * after the caller is on mblog_wait.
+ */
+static bool mblog_arm_wakeup(struct mblog_reader *rd)
+{
+    unsigned long flags;
+    size_t avail = mblog_avail(rd);
+
+    if (avail >= rd->lowat)
+        return true;
+
+    spin_lock_irqsave(&mblog_wait.lock, flags);
+    if (rd->lowat - avail < mblog_wake_lowat)
+        mblog_wake_lowat = rd->lowat - avail;
+    spin_unlock_irqrestore(&mblog_wait.lock, flags);
+
+    // Pairs with wq_has_sleeper() in mblog_wake_readers()
+    smp_mb();
+    return mblog_avail(rd) >= rd->lowat;
+}
+
+// Sleep until at least lowat bytes are waiting for this reader
+static int mblog_wait_data(struct mblog_reader *rd)
+{
+    DEFINE_WAIT(wait);
+    int ret = 0;
+
+    for (;;) {
+        prepare_to_wait(&mblog_wait, &wait, TASK_INTERRUPTIBLE);
+        if (mblog_arm_wakeup(rd))
+            break;
+        if (signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        schedule();
+    }
+    finish_wait(&mblog_wait, &wait);
+    return ret;
+}
+
+static void mblog_reader_free(struct mblog_reader *rd)
+{
+    int cpu;
+
+    // A consumer going away may have been the slowest one
+    if (rd->consumer) {
+        mutex_lock(&mblog_consumers_lock);
+        list_del(&rd->node);
+        mutex_unlock(&mblog_consumers_lock);
+        mblog_reclaim();
+    }
+
+    if (rd->cold) {
+        for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+            kvfree(rd->cold[cpu]);
+        kfree(rd->cold);
+    }
+    kfree(rd->next_seq);
+    kfree(rd);
+}
+
+// Read state for one open file (or the spill thread), positioned at the oldest record
+static struct mblog_reader *mblog_reader_alloc(void)
+{
+    struct mblog_reader *rd;
+
+    rd = kzalloc(struct_size(rd, pos, nr_cpu_ids), GFP_KERNEL);
+    if (!rd)
+        return NULL;
+
+    rd->next_seq = kcalloc(nr_cpu_ids, sizeof(*rd->next_seq), GFP_KERNEL);
+    if (mblog_cold)
+        rd->cold = kcalloc(nr_cpu_ids, sizeof(*rd->cold), GFP_KERNEL);
+    if (!rd->next_seq || (mblog_cold && !rd->cold)) {
+        mblog_reader_free(rd);
+        return NULL;
+    }
+
+    mutex_init(&rd->lock);
+    rd->lowat = 1;
+    mblog_rewind(rd);
+    return rd;
+}
+
+// Called when user opens /dev/mblog
+static int mblog_open(struct inode *inode, struct file *file)
+{
+    struct mblog_reader *rd = mblog_reader_alloc();
+
+    if (!rd)
+        return -ENOMEM;
+    file->private_data = rd;
+
+    printk(KERN_INFO "/dev/%s opened\n", DEVICE_NAME);
+    return 0;
+}
+
+// Called when user closes the device
+static int mblog_release(struct inode *inode, struct file *file)
+{
+    mblog_reader_free(file->private_data);
+    printk(KERN_INFO "/dev/%s closed\n", DEVICE_NAME);
+    return 0;
+}
+
+// MBLOG_FMT_TEXT: hand out payload bytes, a record may be split over several calls
+static ssize_t mblog_read_text(struct mblog_reader *rd, char __user *ubuf, size_t len)
+{
+    size_t done = 0, n;
+
+    while (done < len) {
+        // Finish the record left over from the previous call first
+        if (rd->pend_off == rd->pend_len && !mblog_next_record(rd))
+            break;
+
+        n = min(len - done, rd->pend_len - rd->pend_off);
+        if (copy_to_user(ubuf + done, rd->rec + rd->pend_off, n))
+            return done ? done : -EFAULT;
+        rd->pend_off += n;
+        done += n;
+    }
+    return done;
+}
+
+// MBLOG_FMT_RECORD: hand out whole records (header + payload + padding) only
+static ssize_t mblog_read_records(struct mblog_reader *rd, char __user *ubuf, size_t len)
+{
+    static const char zeros[MBLOG_REC_ALIGN];
+    size_t done = 0, size;
+
+    for (;;) {
+        if (rd->pend_off == rd->pend_len && !mblog_next_record(rd))
+            break;
+
+        size = MBLOG_REC_SIZE(rd->hdr.len);
+        if (size > len - done) {
+            // Keep the record for the next call; a buffer that cannot hold one record is an error
+            if (!done)
+                return -EINVAL;
+            break;
+        }
+
+        if (copy_to_user(ubuf + done, &rd->hdr, sizeof(rd->hdr)) ||
+            copy_to_user(ubuf + done + sizeof(rd->hdr), rd->rec, rd->hdr.len) ||
+            copy_to_user(ubuf + done + sizeof(rd->hdr) + rd->hdr.len, zeros,
+                         size - sizeof(rd->hdr) - rd->hdr.len))
+            return done ? done : -EFAULT;
+
+        rd->pend_off = rd->pend_len;
+        done += size;
+    }
+    return done;
+}
+
+/*
+ * Read records from all CPU rings, oldest first, to userspace.
+ * Without MBLOG_SET_FOLLOW a drained log returns 0 (EOF). In follow mode
+ * read() sleeps until lowat bytes are pending, or fails with -EAGAIN
+ * for O_NONBLOCK files that have nothing to read.
+ */
+static ssize_t mblog_read(struct file *file, char __user *ubuf, size_t len, loff_t *off)
+{
+    struct mblog_reader *rd = file->private_data;
+    bool follow = READ_ONCE(rd->follow);
+    ssize_t ret;
+
+    for (;;) {
+        if (follow && !(file->f_flags & O_NONBLOCK)) {
+            ret = mblog_wait_data(rd);
+            if (ret)
+                return ret;
+        }
+
+        if (mutex_lock_interruptible(&rd->lock))
+            return -ERESTARTSYS;
+
+        if (rd->format == MBLOG_FMT_RECORD)
+            ret = mblog_read_records(rd, ubuf, len);
+        else
+            ret = mblog_read_text(rd, ubuf, len);
+
+        mutex_unlock(&rd->lock);
+
+        // Let writers reuse what every consumer has now read
+        if (ret > 0 && READ_ONCE(rd->consumer))
+            mblog_reclaim();
+
+        // Data was cleared or taken by another thread after we woke up: wait again
+        if (ret || !follow)
+            break;
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+    }
+
+    if (ret > 0)
+        *off += ret;
+    return ret;
+}
+
+// Readable once lowat bytes are pending; writes never block
+static __poll_t mblog_poll(struct file *file, poll_table *wait)
+{
+    struct mblog_reader *rd = file->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(file, &mblog_wait, wait);
+    if (mblog_arm_wakeup(rd))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    return mask;
+}
+
+// Only rewinding to the start of the log is supported
+static loff_t mblog_llseek(struct file *file, loff_t offset, int whence)
+{
+    struct mblog_reader *rd = file->private_data;
+
+    if (whence != SEEK_SET || offset != 0)
+        return -EINVAL;
+
+    mutex_lock(&rd->lock);
+    mblog_rewind(rd);
+    mutex_unlock(&rd->lock);
+
+    file->f_pos = 0;
+    return 0;
+}
+
+/*
+ * write() and writev() from user space. Every iovec becomes one record
+ * (iovecs longer than MBLOG_MAX_RECORD are split) and the whole call is
+ * appended to the current CPU ring under one reservation. Calls larger
+ * than MBLOG_MAX_BATCH_* return a short count.
+ */
+static ssize_t mblog_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    char small[128];
+    u32 small_lens[4];
+    char *kbuf = small;
+    u32 *lens = small_lens;
+    size_t cap, max_recs, seg, staged = 0, need = 0;
+    unsigned long empty = 0;
+    int nrec = 0;
+    ssize_t ret;
+
+    cap = min3(iov_iter_count(from), (size_t)MBLOG_MAX_BATCH_BYTES, READ_ONCE(ring_size));
+    if (!cap)
+        return 0;
+    max_recs = min_t(size_t, MBLOG_MAX_BATCH_RECS,
+                     from->nr_segs + cap / MBLOG_MAX_RECORD + 1);
+
+    // copy_from_iter may fault and sleep, so stage everything before touching the ring
+    if (cap > sizeof(small)) {
+        kbuf = kvmalloc(cap, GFP_KERNEL);
+        if (!kbuf)
+            return -ENOMEM;
+    }
+    if (max_recs > ARRAY_SIZE(small_lens)) {
+        lens = kmalloc_array(max_recs, sizeof(*lens), GFP_KERNEL);
+        if (!lens) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    while (nrec < max_recs && staged < cap && iov_iter_count(from)) {
+        seg = min3(iov_iter_single_seg_count(from), (size_t)MBLOG_MAX_RECORD, cap - staged);
+        if (!seg) {
+            // Empty iovec: step over it (bounded, in case the iterator does not move)
+            if (++empty > from->nr_segs)
+                break;
+            iov_iter_advance(from, 0);
+            continue;
+        }
+        if (need + MBLOG_REC_SIZE(seg) > READ_ONCE(ring_size))
+            break;
+
+        if (copy_from_iter(kbuf + staged, seg, from) != seg) {
+            if (!nrec) {
+                ret = -EFAULT;
+                goto out;
+            }
+            break;  // log what was copied before the fault
+        }
+        lens[nrec++] = seg;
+        staged += seg;
+        need += MBLOG_REC_SIZE(seg);
+    }
+
+    ret = mblog_append_batch(kbuf, lens, nrec, MBLOG_SRC_USER, mblog_user_source());
+
+out:
+    if (lens != small_lens)
+        kfree(lens);
+    if (kbuf != small)
+        kvfree(kbuf);
+    return ret;
+}
+
+// Write logs from another kernel module (exported function, see mblog_kernel.h)
+ssize_t mblog_write_kernel(const char *kbuf, size_t len)
+{
+    if (!kbuf)
+        return -EINVAL;
+
+    return mblog_append(kbuf, len, MBLOG_SRC_KERNEL,
+                        mblog_get_source(_RET_IP_, 0, MBLOG_SRC_KERNEL));
+}
+EXPORT_SYMBOL(mblog_write_kernel);  // Allow other modules to use this function
+
+// Log from IRQ handlers, tasklets, timers... A full ring or the rate limit drops and counts the record.
+bool mblog_write_kernel_atomic(const char *kbuf, size_t len)
+{
+    return mblog_append(kbuf, len, MBLOG_SRC_KERNEL,
+                        mblog_get_source(_RET_IP_, 0, MBLOG_SRC_KERNEL)) > 0;
+}
+EXPORT_SYMBOL(mblog_write_kernel_atomic);
+
+// Bytes held in all rings, headers included (enough to size a read buffer)
+static size_t mblog_stored(void)
+{
+    struct mblog_ring *r;
+    size_t total = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        r = per_cpu_ptr(&mblog_rings, cpu);
+        total += READ_ONCE(r->ctl->head) - READ_ONCE(r->ctl->tail);
+    }
+    return total;
+}
+
+// Records rejected by full rings so far, over all CPUs
+static u64 mblog_dropped(void)
+{
+    u64 total = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        total += READ_ONCE(per_cpu_ptr(&mblog_rings, cpu)->dropped);
+    return total;
+}
+
+/*
+ * Seal every full segment of one ring: copy it out like a reader, compress
+ * it, add it to the cold list and move tail past it (never past a
+ * registered consumer, those must still read the records from the ring).
+ */
+static void mblog_seal_ring(int cpu)
+{
+    struct mblog_ring *r = per_cpu_ptr(&mblog_rings, cpu);
+    struct mblog_seg *seg, *old;
+    struct mblog_rec *hdr;
+    unsigned long head, tail, start, end;
+    size_t seg_size, len;
+    unsigned int clen;
+    bool raw;
+
+    for (;;) {
+        seg_size = mblog_seg_size();
+        head = smp_load_acquire(&r->ctl->head);
+        tail = READ_ONCE(r->ctl->tail);
+        start = r->sealed;
+        if (pos_before(start, tail)) {
+            // Overwritten or cleared before we got to it
+            mblog_cold_lost += tail - start;
+            start = tail;
+            WRITE_ONCE(r->sealed, start);
+        }
+        if (head - start < seg_size)
+            return;
+
+        rcu_read_lock();
+        ring_copy_out(rcu_dereference(r->buf), start, mblog_seal_buf, seg_size);
+        rcu_read_unlock();
+        smp_rmb();
+        if (pos_before(start, READ_ONCE(r->ctl->tail)))
+            continue;
+
+        // Whole records only; a segment always holds at least one of them
+        end = start;
+        while (end - start + sizeof(*hdr) <= seg_size) {
+            hdr = (struct mblog_rec *)(mblog_seal_buf + (end - start));
+            if (end - start + MBLOG_REC_SIZE(hdr->len) > seg_size)
+                break;
+            end += MBLOG_REC_SIZE(hdr->len);
+        }
+        len = end - start;
+
+        clen = 2 * MBLOG_SEG_SIZE;
+        raw = crypto_comp_compress(mblog_comp_tfm, (u8 *)mblog_seal_buf, len,
+                                   (u8 *)mblog_comp_buf, &clen) || clen >= len;
+        if (raw)
+            clen = len;
+
+        seg = kvmalloc(struct_size(seg, data, clen), GFP_KERNEL);
+        if (!seg)
+            return;     // retried on the next kick, or lost if overwritten by then
+        seg->start = start;
+        seg->end = end;
+        seg->clen = clen;
+        seg->raw = raw;
+        memcpy(seg->data, raw ? mblog_seal_buf : mblog_comp_buf, clen);
+
+        mutex_lock(&mblog_cold_lock);
+        list_add_tail(&seg->node, &r->cold);
+        r->cold_bytes += clen;
+        mblog_cold_segments++;
+        mblog_cold_stored += clen;
+        mblog_cold_raw += len;
+
+        // Keep at most cold_kb of history for this CPU
+        while (r->cold_bytes > (size_t)cold_kb * 1024) {
+            old = list_first_entry(&r->cold, struct mblog_seg, node);
+            list_del(&old->node);
+            r->cold_bytes -= old->clen;
+            mblog_cold_segments--;
+            mblog_cold_stored -= old->clen;
+            mblog_cold_raw -= old->end - old->start;
+            kvfree(old);
+        }
+        mutex_unlock(&mblog_cold_lock);
+
+        WRITE_ONCE(r->sealed, end);
+
+        // The records are safe in the segment, give writers the space back
+        mutex_lock(&mblog_consumers_lock);
+        ring_advance_tail(r, READ_ONCE(r->ctl->tail), mblog_consumers_min(cpu, end));
+        mutex_unlock(&mblog_consumers_lock);
+
+        cond_resched();
+    }
+}
+
+// Queued by writers when a segment is full; one at a time (ordered workqueue)
+static void mblog_seal_work_fn(struct work_struct *work)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        mblog_seal_ring(cpu);
+}
+
+// Drop all cold segments (MBLOG_CLEAR), readers' decompressed copies go stale too
+static void mblog_cold_clear(void)
+{
+    struct mblog_seg *seg, *tmp;
+    struct mblog_ring *r;
+    int cpu;
+
+    mutex_lock(&mblog_cold_lock);
+    atomic_inc(&mblog_cold_gen);
+    for_each_possible_cpu(cpu) {
+        r = per_cpu_ptr(&mblog_rings, cpu);
+        list_for_each_entry_safe(seg, tmp, &r->cold, node) {
+            list_del(&seg->node);
+            kvfree(seg);
+        }
+        r->cold_bytes = 0;
+    }
+    mblog_cold_segments = 0;
+    mblog_cold_stored = 0;
+    mblog_cold_raw = 0;
+    mutex_unlock(&mblog_cold_lock);
+}
+
+// Start sealing if cold_kb is set; a missing compressor only disables it
+static int mblog_cold_init(void)
+{
+    if (cold_kb <= 0)
+        return 0;
+
+    mblog_comp_tfm = crypto_alloc_comp(cold_alg, 0, 0);
+    if (IS_ERR(mblog_comp_tfm)) {
+        pr_warn("mblog: compressor %s not available, cold segments disabled\n", cold_alg);
+        mblog_comp_tfm = NULL;
+        return 0;
+    }
+    mblog_decomp_tfm = crypto_alloc_comp(cold_alg, 0, 0);
+    if (IS_ERR(mblog_decomp_tfm)) {
+        mblog_decomp_tfm = NULL;
+        goto err;
+    }
+
+    mblog_seal_buf = vmalloc(MBLOG_SEG_SIZE);
+    mblog_comp_buf = vmalloc(2 * MBLOG_SEG_SIZE);
+    mblog_cold_wq = alloc_ordered_workqueue("mblog_seal", 0);
+    if (!mblog_seal_buf || !mblog_comp_buf || !mblog_cold_wq)
+        goto err;
+
+    mblog_cold = true;
+    return 0;
+
+err:
+    if (mblog_cold_wq)
+        destroy_workqueue(mblog_cold_wq);
+    mblog_cold_wq = NULL;
+    vfree(mblog_comp_buf);
+    vfree(mblog_seal_buf);
+    if (mblog_decomp_tfm)
+        crypto_free_comp(mblog_decomp_tfm);
+    crypto_free_comp(mblog_comp_tfm);
+    return -ENOMEM;
+}
+
+static void mblog_cold_exit(void)
+{
+    if (!mblog_cold)
+        return;
+
+    mblog_cold = false;
+    destroy_workqueue(mblog_cold_wq);   // waits for a running seal
+    mblog_cold_clear();
+    vfree(mblog_comp_buf);
+    vfree(mblog_seal_buf);
+    crypto_free_comp(mblog_decomp_tfm);
+    crypto_free_comp(mblog_comp_tfm);
+}
+
+// MBLOG_REGISTER: keep records until this file has read them too
+static int mblog_register(struct mblog_reader *rd, const struct mblog_consumer_reg *reg)
+{
+    int ret = 0;
+
+    mutex_lock(&mblog_consumers_lock);
+    if (rd->consumer) {
+        ret = -EBUSY;
+        goto out;
+    }
+
+    mutex_lock(&rd->lock);
+    strscpy(rd->name, reg->name, sizeof(rd->name));
+    rd->id = mblog_next_consumer_id++;
+    rd->pid = task_tgid_nr(current);
+    mutex_unlock(&rd->lock);
+
+    // From here on tails never move past this file's cursors (except in overwrite mode)
+    list_add_tail(&rd->node, &mblog_consumers);
+    WRITE_ONCE(rd->consumer, true);
+out:
+    mutex_unlock(&mblog_consumers_lock);
+    return ret;
+}
+
+static int mblog_unregister(struct mblog_reader *rd)
+{
+    mutex_lock(&mblog_consumers_lock);
+    if (!rd->consumer) {
+        mutex_unlock(&mblog_consumers_lock);
+        return -EINVAL;
+    }
+    list_del(&rd->node);
+    WRITE_ONCE(rd->consumer, false);
+    mutex_unlock(&mblog_consumers_lock);
+
+    mblog_reclaim();
+    return 0;
+}
+
+// MBLOG_CLEAR on a consumer: skip everything it has not read yet
+static void mblog_consumer_skip(struct mblog_reader *rd)
+{
+    int cpu;
+
+    mutex_lock(&rd->lock);
+    for_each_possible_cpu(cpu) {
+        rd->pos[cpu] = smp_load_acquire(&per_cpu_ptr(&mblog_rings, cpu)->ctl->head);
+        rd->next_seq[cpu] = MBLOG_SEQ_UNKNOWN;
+    }
+    rd->pend_len = 0;
+    rd->pend_off = 0;
+    mutex_unlock(&rd->lock);
+
+    mblog_reclaim();
+}
+
+// MBLOG_GET_CONSUMERS: one mblog_consumer_info per registered consumer, plus the slowest
+static int mblog_get_consumers(struct mblog_consumers __user *uarg)
+{
+    struct mblog_consumer_info __user *entries;
+    struct mblog_consumer_info info;
+    struct mblog_consumers req;
+    struct mblog_reader *rd;
+    u32 n = 0;
+    int ret = 0;
+
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+    entries = u64_to_user_ptr(req.entries);
+    req.slowest_id = 0;
+    req.max_lag = 0;
+
+    mutex_lock(&mblog_consumers_lock);
+    list_for_each_entry(rd, &mblog_consumers, node) {
+        memset(&info, 0, sizeof(info));
+        mutex_lock(&rd->lock);
+        memcpy(info.name, rd->name, sizeof(info.name));
+        info.id = rd->id;
+        info.pid = rd->pid;
+        info.lag = mblog_avail(rd);
+        info.records = rd->seq_info.records;
+        info.missed = rd->seq_info.missed;
+        mutex_unlock(&rd->lock);
+
+        if (!req.slowest_id || info.lag > req.max_lag) {
+            req.slowest_id = info.id;
+            req.max_lag = info.lag;
+        }
+        if (entries && n < req.count &&
+            copy_to_user(&entries[n], &info, sizeof(info))) {
+            ret = -EFAULT;
+            break;
+        }
+        n++;
+    }
+    mutex_unlock(&mblog_consumers_lock);
+
+    if (ret)
+        return ret;
+    req.count = n;
+    return copy_to_user(uarg, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+static struct mblog_buf *mblog_buf_alloc(size_t size)
+{
+    struct mblog_buf *b = kmalloc(sizeof(*b), GFP_KERNEL);
+
+    if (!b)
+        return NULL;
+    // vmalloc_user() memory is zeroed, page granular and may be mapped into user space
+    b->data = vmalloc_user(size);
+    if (!b->data) {
+        kfree(b);
+        return NULL;
+    }
+    b->size = size;
+    return b;
+}
+
+static void mblog_buf_free(struct mblog_buf *b)
+{
+    if (b) {
+        vfree(b->data);
+        kfree(b);
+    }
+}
+
+// Copy ring positions [pos, pos + len) from one buffer to another of any size
+static void ring_transfer(struct mblog_buf *dst, const struct mblog_buf *src,
+                          unsigned long pos, size_t len)
+{
+    size_t soff, doff, n;
+
+    while (len) {
+        soff = pos & (src->size - 1);
+        doff = pos & (dst->size - 1);
+        n = min3(len, src->size - soff, dst->size - doff);
+        memcpy(dst->data + doff, src->data + soff, n);
+        pos += n;
+        len -= n;
+    }
+}
+
+/*
+ * First record boundary at or after tail from which the records up to
+ * head fit in size bytes. Only the owning CPU writes the ring, so this
+ * may race with it: a header overwritten under us restarts from the new tail.
+ */
+static unsigned long ring_fit_start(struct mblog_ring *r, const struct mblog_buf *b,
+                                    unsigned long from, unsigned long head, size_t size)
+{
+    struct mblog_rec hdr;
+    unsigned long tail, pos = from;
+
+    for (;;) {
+        tail = READ_ONCE(r->ctl->tail);
+        if (pos_before(pos, tail))
+            pos = tail;
+        if (head - pos <= size)
+            return pos;
+
+        ring_copy_out(b, pos, &hdr, sizeof(hdr));
+        smp_rmb();
+        if (pos_before(pos, READ_ONCE(r->ctl->tail)))
+            continue;
+        pos += MBLOG_REC_SIZE(hdr.len);
+    }
+}
+
+// Bytes a writer may add before the final switch has to copy them with writes paused
+#define MBLOG_RESIZE_SLACK  (16 * 1024)
+
+struct mblog_swap {
+    struct mblog_ring *r;
+    struct mblog_buf *old, *new;
+    unsigned long copied;   // positions before this are already in new
+    unsigned long start;    // record boundary the new buffer holds from
+    bool done;              // set by mblog_swap_buf() once writers use new
+};
+
+/*
+ * Runs on the ring's own CPU with interrupts off (IPI), so no writer is in
+ * the middle of an append: copy what was added since the last pass, drop
+ * the oldest records that no longer fit and switch writers and readers over.
+ * If writers got far ahead again since the last pass, it does nothing and
+ * leaves done false: the caller catches up with interrupts on and retries,
+ * so the time spent here stays bounded by MBLOG_RESIZE_SLACK.
+ */
+static void mblog_swap_buf(void *arg)
+{
+    struct mblog_swap *sw = arg;
+    struct mblog_ring *r = sw->r;
+    unsigned long head = r->ctl->head, tail, from;
+
+    sw->done = head - sw->copied <= 2 * MBLOG_RESIZE_SLACK;
+    if (!sw->done)
+        return;
+
+    from = sw->copied;
+    if (head - from > sw->new->size)
+        from = head - sw->new->size;
+    ring_transfer(sw->new, sw->old, from, head - from);
+
+    tail = READ_ONCE(r->ctl->tail);
+    from = ring_fit_start(r, sw->old, pos_before(sw->start, tail) ? tail : sw->start,
+                          head, sw->new->size);
+    ring_advance_tail(r, tail, from);
+
+    // Publishes the copied bytes and orders the new tail before the new buffer
+    rcu_assign_pointer(r->buf, sw->new);
+}
+
+// Move one ring into a buffer of a different size while its writers keep going
+static void mblog_resize_ring(int cpu, struct mblog_buf *new)
+{
+    struct mblog_swap sw = { .r = per_cpu_ptr(&mblog_rings, cpu), .new = new };
+    struct mblog_ring *r = sw.r;
+    unsigned long head, tail;
+
+    sw.old = rcu_dereference_protected(r->buf, lockdep_is_held(&mblog_resize_lock));
+
+    // Copy the bulk of the log without stopping anybody, like a reader would
+    head = smp_load_acquire(&r->ctl->head);
+    tail = READ_ONCE(r->ctl->tail);
+    sw.start = ring_fit_start(r, sw.old, tail, head, new->size);
+    ring_transfer(new, sw.old, sw.start, head - sw.start);
+    sw.copied = head;
+
+    /*
+     * Catch up with busy writers, preemptible, until only a short tail is
+     * left for the switch with interrupts off. Moving start along as well
+     * keeps the record walk in mblog_swap_buf() just as short.
+     */
+    for (;;) {
+        head = smp_load_acquire(&r->ctl->head);
+        if (head - sw.copied > MBLOG_RESIZE_SLACK) {
+            if (head - sw.copied > new->size)
+                sw.copied = head - new->size;
+            ring_transfer(new, sw.old, sw.copied, head - sw.copied);
+            sw.copied = head;
+            sw.start = ring_fit_start(r, sw.old, sw.start, head, new->size);
+            cond_resched();
+            continue;
+        }
+
+        // An offline CPU has no writers, switch it from here
+        if (smp_call_function_single(cpu, mblog_swap_buf, &sw, 1))
+            mblog_swap_buf(&sw);
+        if (sw.done)
+            break;
+        cond_resched();
+    }
+}
+
+/*
+ * MBLOG_SET_RING_SIZE: give every CPU a ring of size bytes (rounded up to
+ * a power of two). Records are kept, except the oldest ones that do not
+ * fit when shrinking. Writers only pause for the final copy on their CPU.
+ */
+static int mblog_resize(size_t size)
+{
+    struct mblog_buf **old;
+    struct mblog_buf *b;
+    int cpu, ret = 0;
+
+    if (size < 2 * MBLOG_REC_SIZE(MBLOG_MAX_RECORD) || size > MBLOG_MAX_RING_SIZE)
+        return -EINVAL;
+    size = roundup_pow_of_two(max_t(size_t, size, PAGE_SIZE));
+
+    old = kcalloc(nr_cpu_ids, sizeof(*old), GFP_KERNEL);
+    if (!old)
+        return -ENOMEM;
+
+    mutex_lock(&mblog_resize_lock);
+    // Mappings hold the old pages and the old layout
+    if (atomic_read(&mblog_maps)) {
+        ret = -EBUSY;
+        goto out;
+    }
+    if (size == ring_size)
+        goto out;
+
+    // Allocate everything first, so a failure leaves the log untouched
+    for_each_possible_cpu(cpu) {
+        old[cpu] = mblog_buf_alloc(size);
+        if (!old[cpu]) {
+            ret = -ENOMEM;
+            goto out;
+        }
+    }
+
+    cpus_read_lock();
+    for_each_possible_cpu(cpu) {
+        b = rcu_dereference_protected(per_cpu_ptr(&mblog_rings, cpu)->buf,
+                                      lockdep_is_held(&mblog_resize_lock));
+        mblog_resize_ring(cpu, old[cpu]);
+        old[cpu] = b;   // now the one to free
+    }
+    cpus_read_unlock();
 
-// Semaphore for write synchronization
-static struct semaphore lock;   
+    WRITE_ONCE(ring_size, size);
+    bufsize = size;
+    mblog_hdr->ring_size = size;
+    mblog_hdr->map_size = ctl_size + (u64)nr_cpu_ids * size;
 
+    // Readers still copying out of the old buffers are done after this
+    synchronize_rcu();
+out:
+    mutex_unlock(&mblog_resize_lock);
+    for_each_possible_cpu(cpu)
+        mblog_buf_free(old[cpu]);
+    kfree(old);
+    return ret;
+}
 
-// Called when user opens /dev/mblog
-static int mblog_open(struct inode *inode, struct file *file)
+// Limit every source of one type that has no limit of its own
+static void mblog_set_default_limit(u16 type, u64 rate, u64 burst)
 {
-    printk(KERN_INFO "/dev/%s opened\n", DEVICE_NAME);
-    return 0;
+    WRITE_ONCE(mblog_burst[type], burst ? burst : rate);
+    WRITE_ONCE(mblog_rate[type], rate);
 }
 
-// Called when user closes the device
-static int mblog_release(struct inode *inode, struct file *file)
+// MBLOG_SET_RATELIMIT
+static int mblog_set_ratelimit(const struct mblog_ratelimit *rl)
 {
-    printk(KERN_INFO "/dev/%s closed\n", DEVICE_NAME);
+    struct mblog_source *s;
+    struct task_struct *t;
+    unsigned long tgid;
+    u64 stamp;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if (rl->type > MBLOG_SRC_KERNEL || (rl->pid && rl->type != MBLOG_SRC_USER))
+        return -EINVAL;
+    // Keeps rate * elapsed ns inside 64 bits in mblog_rate_ok()
+    if (rl->rate > U32_MAX || rl->burst > U32_MAX)
+        return -EINVAL;
+
+    if (!rl->pid) {
+        mblog_set_default_limit(rl->type, rl->rate, rl->burst);
+        return 0;
+    }
+
+    // The entry belongs to this very process, not to whoever gets its pid later
+    rcu_read_lock();
+    t = pid_task(find_vpid(rl->pid), PIDTYPE_TGID);
+    if (!t) {
+        rcu_read_unlock();
+        return -ESRCH;
+    }
+    tgid = task_tgid_nr(t);
+    stamp = t->start_time;
+    rcu_read_unlock();
+
+    s = mblog_get_source(tgid, stamp, MBLOG_SRC_USER);
+    if (s == &mblog_other[MBLOG_SRC_USER])
+        return -ENOSPC;     // table full, the process cannot get a bucket of its own
+    atomic64_set(&s->tokens, rl->burst ? rl->burst : rl->rate);
+    WRITE_ONCE(s->burst, rl->burst ? rl->burst : rl->rate);
+    WRITE_ONCE(s->rate, rl->rate);
     return 0;
 }
 
-// Read data from buffer to userspace
-static ssize_t mblog_read(struct file *file, char __user *ubuf, size_t len, loff_t *off)
+static void mblog_source_stats(struct mblog_source *s, struct mblog_source_stats *st)
 {
-    ssize_t ret;
+    unsigned long key = READ_ONCE(s->key);
 
-    // If already at end of buffer, return 0 (EOF)
-    if (*off >= log_len)
-        return 0;
+    memset(st, 0, sizeof(*st));
+    st->type = READ_ONCE(s->type);
+    if (!key)
+        snprintf(st->name, sizeof(st->name), "other");
+    else if (st->type == MBLOG_SRC_USER) {
+        st->pid = key;
+        snprintf(st->name, sizeof(st->name), "pid %lu", key);
+    } else {
+        snprintf(st->name, sizeof(st->name), "%ps", (void *)key);
+    }
+    st->accepted = atomic64_read(&s->accepted);
+    st->throttled = atomic64_read(&s->throttled);
+    st->dropped = atomic64_read(&s->dropped);
+}
+
+// Source number i of the table followed by the shared ones, NULL if never used
+static struct mblog_source *mblog_source_at(u32 i)
+{
+    struct mblog_source *s;
+
+    if (i < MBLOG_NR_SOURCES) {
+        s = &mblog_sources[i];
+        return READ_ONCE(s->key) ? s : NULL;
+    }
+    s = &mblog_other[i - MBLOG_NR_SOURCES];
+    if (atomic64_read(&s->accepted) || atomic64_read(&s->throttled) ||
+        atomic64_read(&s->dropped))
+        return s;
+    return NULL;
+}
 
-    // Lock before reading
-    if (down_interruptible(&lock))
-        return -ERESTARTSYS;
+#define MBLOG_NR_ALL_SOURCES    (MBLOG_NR_SOURCES + ARRAY_SIZE(mblog_other))
 
-    // Adjust read length if user requests more than available
-    if (len > (log_len - *off))
-        len = log_len - *off;
+// MBLOG_GET_STATS: totals plus one mblog_source_stats per source
+static int mblog_get_stats(struct mblog_stats __user *uarg)
+{
+    struct mblog_source_stats __user *entries;
+    struct mblog_source_stats st;
+    struct mblog_stats req;
+    struct mblog_source *s;
+    u32 i, n = 0;
 
-    // Copy data to user buffer
-    if (copy_to_user(ubuf, log_buffer + *off, len))
-        ret = -EFAULT;
-    else
-        ret = len;
+    if (copy_from_user(&req, uarg, sizeof(req)))
+        return -EFAULT;
+    entries = u64_to_user_ptr(req.entries);
+    req.accepted = req.throttled = req.dropped = 0;
+
+    for (i = 0; i < MBLOG_NR_ALL_SOURCES; i++) {
+        s = mblog_source_at(i);
+        if (!s)
+            continue;
+        mblog_source_stats(s, &st);
+        req.accepted += st.accepted;
+        req.throttled += st.throttled;
+        req.dropped += st.dropped;
+        if (entries && n < req.count && copy_to_user(&entries[n], &st, sizeof(st)))
+            return -EFAULT;
+        n++;
+    }
+
+    req.count = n;
+    return copy_to_user(uarg, &req, sizeof(req)) ? -EFAULT : 0;
+}
+
+// IOCTL handler
+static long mblog_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct mblog_reader *rd = file->private_data;
+    struct mblog_seq_info info;
+    struct mblog_consumer_reg reg;
+    struct mblog_ratelimit rl;
+    struct mblog_ring *r;
+    u64 dropped, new_size;
+    size_t size;
+    long ret = 0;
+    int cpu, mode, format, follow;
+    u32 lowat;
+
+    switch (cmd) {
+
+    case MBLOG_CLEAR:     // Drop everything written so far, on every CPU
+        if (READ_ONCE(rd->consumer)) {
+            mblog_consumer_skip(rd);
+            break;
+        }
+        // Wiping the rings would take unread records away from the consumers
+        if (!list_empty(&mblog_consumers))
+            return -EBUSY;
+        for_each_possible_cpu(cpu) {
+            r = per_cpu_ptr(&mblog_rings, cpu);
+            ring_advance_tail(r, READ_ONCE(r->ctl->tail), smp_load_acquire(&r->ctl->head));
+        }
+        if (mblog_cold)
+            mblog_cold_clear();
+        break;
+
+    case MBLOG_GET_SIZE:  // Send current log size to user
+        size = mblog_stored();
+        if (copy_to_user((size_t __user *)arg, &size, sizeof(size)))
+            ret = -EFAULT;
+        break;
+
+    case MBLOG_SET_MODE:  // Choose what happens when a ring is full
+        if (copy_from_user(&mode, (int __user *)arg, sizeof(mode)))
+            return -EFAULT;
+        if (mode != MBLOG_MODE_STOP && mode != MBLOG_MODE_OVERWRITE)
+            return -EINVAL;
+        WRITE_ONCE(overwrite, mode == MBLOG_MODE_OVERWRITE);
+        break;
+
+    case MBLOG_SET_FORMAT:  // Text stream or whole records for this file
+        if (copy_from_user(&format, (int __user *)arg, sizeof(format)))
+            return -EFAULT;
+        if (format != MBLOG_FMT_TEXT && format != MBLOG_FMT_RECORD)
+            return -EINVAL;
+        mutex_lock(&rd->lock);
+        rd->format = format;
+        rd->pend_off = 0;   // a partly returned record is handed out again in full
+        mutex_unlock(&rd->lock);
+        break;
+
+    case MBLOG_SET_FOLLOW:  // Blocking tail-follow reads on this file
+        if (copy_from_user(&follow, (int __user *)arg, sizeof(follow)))
+            return -EFAULT;
+        WRITE_ONCE(rd->follow, follow != 0);
+        break;
+
+    case MBLOG_SET_LOWAT:   // Pending bytes needed to wake read()/poll() on this file
+        if (copy_from_user(&lowat, (__u32 __user *)arg, sizeof(lowat)))
+            return -EFAULT;
+        WRITE_ONCE(rd->lowat, max_t(u32, lowat, 1));
+        break;
+
+    case MBLOG_GET_DROPPED: // Records writers could not store (stop mode)
+        dropped = mblog_dropped();
+        if (copy_to_user((__u64 __user *)arg, &dropped, sizeof(dropped)))
+            ret = -EFAULT;
+        break;
+
+    case MBLOG_GET_MISSED:  // Sequence accounting of this reader
+        mutex_lock(&rd->lock);
+        info = rd->seq_info;
+        mutex_unlock(&rd->lock);
+        if (copy_to_user((struct mblog_seq_info __user *)arg, &info, sizeof(info)))
+            ret = -EFAULT;
+        break;
+
+    case MBLOG_REGISTER:    // Become a consumer that holds back reclaim
+        if (copy_from_user(&reg, (struct mblog_consumer_reg __user *)arg, sizeof(reg)))
+            return -EFAULT;
+        ret = mblog_register(rd, &reg);
+        break;
+
+    case MBLOG_UNREGISTER:
+        ret = mblog_unregister(rd);
+        break;
+
+    case MBLOG_GET_CONSUMERS:   // Lag of every consumer and which one is slowest
+        ret = mblog_get_consumers((struct mblog_consumers __user *)arg);
+        break;
+
+    case MBLOG_SET_RING_SIZE:   // Grow or shrink every CPU ring, returns the size used
+        // Reallocates every CPU ring and briefly stalls all writers: root only
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (copy_from_user(&new_size, (__u64 __user *)arg, sizeof(new_size)))
+            return -EFAULT;
+        ret = mblog_resize(new_size);
+        new_size = READ_ONCE(ring_size);
+        if (!ret && copy_to_user((__u64 __user *)arg, &new_size, sizeof(new_size)))
+            ret = -EFAULT;
+        break;
+
+    case MBLOG_SET_RATELIMIT:   // Token bucket of all user/kernel sources or of one process
+        if (copy_from_user(&rl, (struct mblog_ratelimit __user *)arg, sizeof(rl)))
+            return -EFAULT;
+        ret = mblog_set_ratelimit(&rl);
+        break;
+
+    case MBLOG_GET_STATS:       // Accepted, throttled and dropped bytes per source
+        ret = mblog_get_stats((struct mblog_stats __user *)arg);
+        break;
+
+    default:
+        ret = -EINVAL;
+    }
 
-    up(&lock);
     return ret;
 }
 
-// Write data from user to kernel buffer
-static ssize_t mblog_write(struct file *file, const char __user *ubuf, size_t len, loff_t *off)
+// Insert the pages of one vmalloc_user() area at *addr, stopping at the end of the vma
+static int mblog_map_area(struct vm_area_struct *vma, unsigned long *addr, void *area, size_t len)
 {
-    ssize_t ret = 0;
+    size_t off;
+    int ret;
+
+    for (off = 0; off < len && *addr < vma->vm_end; off += PAGE_SIZE) {
+        ret = vm_insert_page(vma, *addr, vmalloc_to_page((char *)area + off));
+        if (ret)
+            return ret;
+        *addr += PAGE_SIZE;
+    }
+    return 0;
+}
+
+// Count live mappings (fork and split copy them), MBLOG_SET_RING_SIZE waits for none
+static void mblog_vma_open(struct vm_area_struct *vma)
+{
+    atomic_inc(&mblog_maps);
+}
 
-    // Lock buffer
-    if (down_interruptible(&lock))
-        return -ERESTARTSYS;
+static void mblog_vma_close(struct vm_area_struct *vma)
+{
+    atomic_dec(&mblog_maps);
+}
+
+static const struct vm_operations_struct mblog_vm_ops = {
+    .open = mblog_vma_open,
+    .close = mblog_vma_close,
+};
+
+/*
+ * Map the control area and every CPU ring read-only into the caller
+ * (layout in mblog.h). Readers then follow head/tail with plain loads.
+ * A compat task would see unsigned long head/tail with the wrong size.
+ */
+static int mblog_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    unsigned long addr = vma->vm_start;
+    struct mblog_buf *b;
+    int cpu, ret;
+
+    if (in_compat_syscall())
+        return -EINVAL;
 
-    // Check available space
-    if (len > bufsize - log_len)
-        len = bufsize - log_len;
+    // Log pages are never writable from user space
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
 
-    if (len == 0) {
-        ret = -ENOSPC; // No space left
+    // The ring buffers cannot be swapped while we insert their pages
+    mutex_lock(&mblog_resize_lock);
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > mblog_hdr->map_size) {
+        ret = -EINVAL;
         goto out;
     }
 
-    // Copy data from user
-    if (copy_from_user(log_buffer + log_len, ubuf, len))
-        ret = -EFAULT;
-    else {
-        log_len += len;
-        ret = len;
+    ret = mblog_map_area(vma, &addr, mblog_hdr, ctl_size);
+    if (ret)
+        goto out;
+
+    for (cpu = 0; cpu < nr_cpu_ids && addr < vma->vm_end; cpu++) {
+        if (!cpu_possible(cpu)) {
+            addr += ring_size;  // leave a hole, ctl->present is 0
+            continue;
+        }
+        b = rcu_dereference_protected(per_cpu_ptr(&mblog_rings, cpu)->buf,
+                                      lockdep_is_held(&mblog_resize_lock));
+        ret = mblog_map_area(vma, &addr, b->data, b->size);
+        if (ret)
+            goto out;
     }
 
+    vma->vm_ops = &mblog_vm_ops;
+    mblog_vma_open(vma);
 out:
-    up(&lock);
+    mutex_unlock(&mblog_resize_lock);
     return ret;
 }
 
-// Write logs from another kernel module (exported function)
-ssize_t mblog_write_kernel(const char *kbuf, size_t len) 
-{ 
-    ssize_t ret = 0;
+/*
+ * Spill. A kernel thread reads the log like a registered consumer named
+ * "spill" and appends every record (MBLOG_FMT_RECORD layout) to a file.
+ * Records are gathered into spill_batch_kb writes; a partial batch is
+ * written after a second without new data. Being a consumer gives the
+ * back-pressure: ring space is only reclaimed once the records are in
+ * the batch, so a slow disk fills the rings (stop mode rejects writes,
+ * overwrite mode loses records, both show up in the counters below).
+ */
+struct mblog_spill {
+    struct task_struct *task;
+    char *path;
+    struct file *file;
+    struct mblog_reader *rd;
+    char *buf;
+    size_t size, len;
+    u64 last_flush;                 // ktime_get_ns() of the last write
+    // counters for sysfs spill/
+    u64 bytes, writes, errors, stalls;
+    u64 write_ns, last_ns, max_ns;
+    u64 rate_bytes, rate_start, rate; // bytes/s over the last full second
+};
 
-    if (!kbuf)
-        return -EINVAL;
+static struct mblog_spill *mblog_spill;
+static DEFINE_MUTEX(mblog_spill_lock);     // start/stop and spill_path
+
+// Write the batch with one sequential write; on error keep it and retry later
+static int mblog_spill_flush(struct mblog_spill *sp)
+{
+    loff_t pos = 0;     // O_APPEND: always written at the end
+    u64 t0, dt;
+    ssize_t ret;
 
-    if (down_interruptible(&lock))
-        return -ERESTARTSYS;
+    if (!sp->len)
+        return 0;
 
-    if (len > bufsize - log_len)
-        len = bufsize - log_len;
+    t0 = ktime_get_ns();
+    ret = kernel_write(sp->file, sp->buf, sp->len, &pos);
+    dt = ktime_get_ns() - t0;
 
-    if (len == 0) {
-        ret = -ENOSPC;
-        goto out;
+    if (ret != sp->len) {
+        WRITE_ONCE(sp->errors, sp->errors + 1);
+        // A short write leaves part of the batch on disk, keep only the rest
+        if (ret > 0) {
+            memmove(sp->buf, sp->buf + ret, sp->len - ret);
+            sp->len -= ret;
+        }
+        return ret < 0 ? ret : -EIO;
     }
 
-    memcpy(log_buffer + log_len, kbuf, len);
-    log_len += len;
-    ret = len;
+    WRITE_ONCE(sp->bytes, sp->bytes + sp->len);
+    WRITE_ONCE(sp->writes, sp->writes + 1);
+    WRITE_ONCE(sp->write_ns, sp->write_ns + dt);
+    WRITE_ONCE(sp->last_ns, dt);
+    if (dt > sp->max_ns)
+        WRITE_ONCE(sp->max_ns, dt);
 
-out:
-    up(&lock);
-    return ret; 
+    sp->rate_bytes += sp->len;
+    if (t0 + dt - sp->rate_start >= NSEC_PER_SEC) {
+        WRITE_ONCE(sp->rate, div64_u64(sp->rate_bytes * NSEC_PER_SEC, t0 + dt - sp->rate_start));
+        sp->rate_bytes = 0;
+        sp->rate_start = t0 + dt;
+    }
+
+    sp->len = 0;
+    sp->last_flush = t0 + dt;
+    return 0;
 }
-EXPORT_SYMBOL(mblog_write_kernel);  // Allow other modules to use this function
 
-// IOCTL handler
-static long mblog_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+// Move records into the batch until it is full or the log is drained
+static bool mblog_spill_fill(struct mblog_spill *sp)
 {
-    long ret = 0;
+    struct mblog_reader *rd = sp->rd;
+    bool more = true;
+    size_t size;
 
-    if (down_interruptible(&lock))
-        return -ERESTARTSYS;
+    mutex_lock(&rd->lock);
+    while (sp->len + MBLOG_REC_SIZE(MBLOG_MAX_RECORD) <= sp->size) {
+        more = mblog_next_record(rd);
+        if (!more)
+            break;
 
-    switch (cmd) {
+        size = MBLOG_REC_SIZE(rd->hdr.len);
+        memcpy(sp->buf + sp->len, &rd->hdr, sizeof(rd->hdr));
+        memcpy(sp->buf + sp->len + sizeof(rd->hdr), rd->rec, rd->hdr.len);
+        memset(sp->buf + sp->len + sizeof(rd->hdr) + rd->hdr.len, 0,
+               size - sizeof(rd->hdr) - rd->hdr.len);
+        sp->len += size;
+        rd->pend_off = rd->pend_len;
+    }
+    mutex_unlock(&rd->lock);
 
-    case MBLOG_CLEAR:     // Reset buffer
-        log_len = 0;
-        break;
+    // The records are safe in our buffer, writers may reuse their space
+    mblog_reclaim();
+    return more;
+}
 
-    case MBLOG_GET_SIZE:  // Send current log size to user
-        if (copy_to_user((size_t __user *)arg, &log_len, sizeof(log_len)))
-            ret = -EFAULT;
-        break;
+static int mblog_spill_thread(void *arg)
+{
+    struct mblog_spill *sp = arg;
+    DEFINE_WAIT(wait);
+    bool more;
 
-    default:
-        ret = -EINVAL;
+    sp->rate_start = sp->last_flush = ktime_get_ns();
+
+    while (!kthread_should_stop()) {
+        more = mblog_spill_fill(sp);
+
+        // Back-pressure: we are behind by more than half of what the rings hold
+        if (mblog_avail(sp->rd) > (size_t)num_possible_cpus() * READ_ONCE(ring_size) / 2)
+            WRITE_ONCE(sp->stalls, sp->stalls + 1);
+
+        if (sp->len + MBLOG_REC_SIZE(MBLOG_MAX_RECORD) > sp->size ||
+            (sp->len && ktime_get_ns() - sp->last_flush >= NSEC_PER_SEC)) {
+            if (mblog_spill_flush(sp)) {
+                // Disk error: keep the batch, the rings fill up meanwhile
+                schedule_timeout_interruptible(HZ);
+                continue;
+            }
+        }
+        if (more)
+            continue;
+
+        // Sleep until a good part of a batch is waiting, or a second has passed
+        prepare_to_wait(&mblog_wait, &wait, TASK_INTERRUPTIBLE);
+        if (!mblog_arm_wakeup(sp->rd) && !kthread_should_stop())
+            schedule_timeout(HZ);
+        finish_wait(&mblog_wait, &wait);
+    }
+
+    mblog_spill_fill(sp);
+    mblog_spill_flush(sp);
+    return 0;
+}
+
+// Start spilling to path (replacing a running spill); called with mblog_spill_lock
+static int mblog_spill_start(const char *path)
+{
+    struct mblog_consumer_reg reg = { .name = "spill" };
+    struct mblog_spill *sp;
+    int ret;
+
+    sp = kzalloc(sizeof(*sp), GFP_KERNEL);
+    if (!sp)
+        return -ENOMEM;
+
+    sp->size = max_t(size_t, (size_t)spill_batch_kb * 1024, 2 * MBLOG_REC_SIZE(MBLOG_MAX_RECORD));
+    sp->buf = kvmalloc(sp->size, GFP_KERNEL);
+    sp->path = kstrdup(path, GFP_KERNEL);
+    sp->rd = mblog_reader_alloc();
+    if (!sp->buf || !sp->path || !sp->rd) {
+        ret = -ENOMEM;
+        goto err;
+    }
+    // Wake for a quarter batch at a time, not for every record
+    sp->rd->lowat = sp->size / 4;
+
+    sp->file = filp_open(path, O_WRONLY | O_CREAT | O_APPEND | O_LARGEFILE, 0600);
+    if (IS_ERR(sp->file)) {
+        ret = PTR_ERR(sp->file);
+        sp->file = NULL;
+        goto err;
+    }
+
+    ret = mblog_register(sp->rd, &reg);
+    if (ret)
+        goto err;
+
+    sp->task = kthread_run(mblog_spill_thread, sp, "mblog_spill");
+    if (IS_ERR(sp->task)) {
+        ret = PTR_ERR(sp->task);
+        goto err;
+    }
+
+    mblog_spill = sp;
+    pr_info("mblog: spilling to %s\n", path);
+    return 0;
+
+err:
+    if (sp->file)
+        filp_close(sp->file, NULL);
+    if (sp->rd)
+        mblog_reader_free(sp->rd);
+    kfree(sp->path);
+    kvfree(sp->buf);
+    kfree(sp);
+    return ret;
+}
+
+// Flush what is left and stop; called with mblog_spill_lock
+static void mblog_spill_stop(void)
+{
+    struct mblog_spill *sp = mblog_spill;
+
+    if (!sp)
+        return;
+
+    kthread_stop(sp->task);
+    filp_close(sp->file, NULL);
+    mblog_reader_free(sp->rd);     // unregisters the consumer
+    kfree(sp->path);
+    kvfree(sp->buf);
+    kfree(sp);
+    mblog_spill = NULL;
+}
+
+/*
+ * sysfs, under /sys/class/mblog/mblog/:
+ *   stats/{accepted,throttled,dropped}_bytes  totals over all sources
+ *   stats/sources                             one line per source
+ *   ratelimit/{user,kernel}_{rate,burst}      defaults of MBLOG_SET_RATELIMIT
+ *   cold/                                     compressed history (cold_kb)
+ *   spill/                                    spill file and its counters
+ */
+static void mblog_totals(u64 *accepted, u64 *throttled, u64 *dropped)
+{
+    struct mblog_source *s;
+    u32 i;
+
+    *accepted = *throttled = *dropped = 0;
+    for (i = 0; i < MBLOG_NR_ALL_SOURCES; i++) {
+        s = mblog_source_at(i);
+        if (!s)
+            continue;
+        *accepted += atomic64_read(&s->accepted);
+        *throttled += atomic64_read(&s->throttled);
+        *dropped += atomic64_read(&s->dropped);
     }
+}
+
+static ssize_t accepted_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    u64 a, t, d;
+
+    mblog_totals(&a, &t, &d);
+    return sysfs_emit(buf, "%llu\n", a);
+}
+static DEVICE_ATTR_RO(accepted_bytes);
+
+static ssize_t throttled_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    u64 a, t, d;
+
+    mblog_totals(&a, &t, &d);
+    return sysfs_emit(buf, "%llu\n", t);
+}
+static DEVICE_ATTR_RO(throttled_bytes);
+
+static ssize_t dropped_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    u64 a, t, d;
+
+    mblog_totals(&a, &t, &d);
+    return sysfs_emit(buf, "%llu\n", d);
+}
+static DEVICE_ATTR_RO(dropped_bytes);
+
+// "<type> <name> <accepted> <throttled> <dropped>" per source, as much as fits in a page
+static ssize_t sources_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct mblog_source_stats st;
+    struct mblog_source *s;
+    int len = 0;
+    u32 i;
+
+    for (i = 0; i < MBLOG_NR_ALL_SOURCES; i++) {
+        s = mblog_source_at(i);
+        if (!s)
+            continue;
+        mblog_source_stats(s, &st);
+        len += sysfs_emit_at(buf, len, "%s %s %llu %llu %llu\n",
+                             st.type == MBLOG_SRC_USER ? "user" : "kernel", st.name,
+                             st.accepted, st.throttled, st.dropped);
+    }
+    return len;
+}
+static DEVICE_ATTR_RO(sources);
+
+static struct attribute *mblog_stats_attrs[] = {
+    &dev_attr_accepted_bytes.attr,
+    &dev_attr_throttled_bytes.attr,
+    &dev_attr_dropped_bytes.attr,
+    &dev_attr_sources.attr,
+    NULL,
+};
+
+static const struct attribute_group mblog_stats_group = {
+    .name = "stats",
+    .attrs = mblog_stats_attrs,
+};
+
+// Same checks as MBLOG_SET_RATELIMIT (the files are root only)
+static ssize_t mblog_limit_store(u64 *limit, u16 type, const char *buf, size_t count)
+{
+    u64 val;
+    int ret = kstrtou64(buf, 0, &val);
+
+    if (ret)
+        return ret;
+    if (val > U32_MAX)
+        return -EINVAL;
+
+    if (limit == mblog_rate)
+        mblog_set_default_limit(type, val, READ_ONCE(mblog_burst[type]));
+    else
+        mblog_set_default_limit(type, READ_ONCE(mblog_rate[type]), val);
+    return count;
+}
+
+#define MBLOG_LIMIT_ATTR(name, limit, type)                                           \
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{                                                                                     \
+    return sysfs_emit(buf, "%llu\n", READ_ONCE(limit[type]));                         \
+}                                                                                     \
+static ssize_t name##_store(struct device *dev, struct device_attribute *attr,        \
+                            const char *buf, size_t count)                            \
+{                                                                                     \
+    return mblog_limit_store(limit, type, buf, count);                                \
+}                                                                                     \
+static DEVICE_ATTR_RW(name)
 
-    up(&lock);
+MBLOG_LIMIT_ATTR(user_rate, mblog_rate, MBLOG_SRC_USER);
+MBLOG_LIMIT_ATTR(user_burst, mblog_burst, MBLOG_SRC_USER);
+MBLOG_LIMIT_ATTR(kernel_rate, mblog_rate, MBLOG_SRC_KERNEL);
+MBLOG_LIMIT_ATTR(kernel_burst, mblog_burst, MBLOG_SRC_KERNEL);
+
+static struct attribute *mblog_ratelimit_attrs[] = {
+    &dev_attr_user_rate.attr,
+    &dev_attr_user_burst.attr,
+    &dev_attr_kernel_rate.attr,
+    &dev_attr_kernel_burst.attr,
+    NULL,
+};
+
+static const struct attribute_group mblog_ratelimit_group = {
+    .name = "ratelimit",
+    .attrs = mblog_ratelimit_attrs,
+};
+
+// cold/: segments held, their compressed and original size, bytes lost before sealing
+static ssize_t segments_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", READ_ONCE(mblog_cold_segments));
+}
+static DEVICE_ATTR_RO(segments);
+
+static ssize_t stored_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", READ_ONCE(mblog_cold_stored));
+}
+static DEVICE_ATTR_RO(stored_bytes);
+
+static ssize_t raw_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", READ_ONCE(mblog_cold_raw));
+}
+static DEVICE_ATTR_RO(raw_bytes);
+
+static ssize_t lost_bytes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sysfs_emit(buf, "%llu\n", READ_ONCE(mblog_cold_lost));
+}
+static DEVICE_ATTR_RO(lost_bytes);
+
+static struct attribute *mblog_cold_attrs[] = {
+    &dev_attr_segments.attr,
+    &dev_attr_stored_bytes.attr,
+    &dev_attr_raw_bytes.attr,
+    &dev_attr_lost_bytes.attr,
+    NULL,
+};
+
+static const struct attribute_group mblog_cold_group = {
+    .name = "cold",
+    .attrs = mblog_cold_attrs,
+};
+
+// spill/path: write a file name to start spilling there, an empty line to stop
+static ssize_t path_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    ssize_t ret;
+
+    mutex_lock(&mblog_spill_lock);
+    ret = sysfs_emit(buf, "%s\n", mblog_spill ? mblog_spill->path : "");
+    mutex_unlock(&mblog_spill_lock);
     return ret;
 }
 
+static ssize_t path_store(struct device *dev, struct device_attribute *attr,
+                          const char *buf, size_t count)
+{
+    char *path = kstrndup(buf, count, GFP_KERNEL);
+    int ret = 0;
+
+    if (!path)
+        return -ENOMEM;
+    strim(path);
+
+    mutex_lock(&mblog_spill_lock);
+    mblog_spill_stop();
+    if (*path)
+        ret = mblog_spill_start(path);
+    mutex_unlock(&mblog_spill_lock);
+
+    kfree(path);
+    return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(path);
+
+#define MBLOG_SPILL_ATTR(name, expr)                                                   \
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{                                                                                     \
+    struct mblog_spill *sp;                                                           \
+    u64 val = 0;                                                                      \
+                                                                                      \
+    mutex_lock(&mblog_spill_lock);                                                    \
+    sp = mblog_spill;                                                                 \
+    if (sp)                                                                           \
+        val = (expr);                                                                 \
+    mutex_unlock(&mblog_spill_lock);                                                  \
+    return sysfs_emit(buf, "%llu\n", val);                                            \
+}                                                                                     \
+static DEVICE_ATTR_RO(name)
+
+MBLOG_SPILL_ATTR(flushed_bytes, READ_ONCE(sp->bytes));
+MBLOG_SPILL_ATTR(flushes, READ_ONCE(sp->writes));
+MBLOG_SPILL_ATTR(errors, READ_ONCE(sp->errors));
+MBLOG_SPILL_ATTR(throughput_bps, READ_ONCE(sp->rate));
+MBLOG_SPILL_ATTR(last_latency_us, div_u64(READ_ONCE(sp->last_ns), NSEC_PER_USEC));
+MBLOG_SPILL_ATTR(max_latency_us, div_u64(READ_ONCE(sp->max_ns), NSEC_PER_USEC));
+MBLOG_SPILL_ATTR(avg_latency_us, READ_ONCE(sp->writes) ?
+                 div64_u64(READ_ONCE(sp->write_ns), READ_ONCE(sp->writes) * NSEC_PER_USEC) : 0);
+MBLOG_SPILL_ATTR(pending_bytes, mblog_avail(sp->rd) + sp->len);
+MBLOG_SPILL_ATTR(stalls, READ_ONCE(sp->stalls));
+MBLOG_SPILL_ATTR(missed, READ_ONCE(sp->rd->seq_info.missed));
+
+static struct attribute *mblog_spill_attrs[] = {
+    &dev_attr_path.attr,
+    &dev_attr_flushed_bytes.attr,
+    &dev_attr_flushes.attr,
+    &dev_attr_errors.attr,
+    &dev_attr_throughput_bps.attr,
+    &dev_attr_last_latency_us.attr,
+    &dev_attr_max_latency_us.attr,
+    &dev_attr_avg_latency_us.attr,
+    &dev_attr_pending_bytes.attr,
+    &dev_attr_stalls.attr,
+    &dev_attr_missed.attr,
+    NULL,
+};
+
+static const struct attribute_group mblog_spill_group = {
+    .name = "spill",
+    .attrs = mblog_spill_attrs,
+};
+
+static const struct attribute_group *mblog_groups[] = {
+    &mblog_stats_group,
+    &mblog_ratelimit_group,
+    &mblog_cold_group,
+    &mblog_spill_group,
+    NULL,
+};
+
 // File operations structure for driver
 static const struct file_operations mblog_fops = {
     .owner = THIS_MODULE,
     .open = mblog_open,
     .release = mblog_release,
     .read = mblog_read,
-    .write = mblog_write,
+    .write_iter = mblog_write_iter,
+    .llseek = mblog_llseek,
+    .poll = mblog_poll,
+    .mmap = mblog_mmap,
     .unlocked_ioctl = mblog_ioctl,
 };
 
+static void mblog_free_rings(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        mblog_buf_free(rcu_dereference_protected(per_cpu_ptr(&mblog_rings, cpu)->buf, 1));
+        RCU_INIT_POINTER(per_cpu_ptr(&mblog_rings, cpu)->buf, NULL);
+    }
+    vfree(mblog_hdr);
+    mblog_hdr = NULL;
+}
+
+static int mblog_alloc_rings(void)
+{
+    struct mblog_ring *r;
+    struct mblog_buf *b;
+    int cpu;
+
+    if (bufsize < 2 * MBLOG_REC_SIZE(MBLOG_MAX_RECORD))
+        bufsize = 2 * MBLOG_REC_SIZE(MBLOG_MAX_RECORD);
+    // Rings are mapped page by page, so they are at least one page
+    ring_size = roundup_pow_of_two(max_t(size_t, bufsize, PAGE_SIZE));
+
+    // vmalloc_user() memory is zeroed and may be mapped into user space
+    ctl_size = PAGE_ALIGN(struct_size(mblog_hdr, rings, nr_cpu_ids));
+    mblog_hdr = vmalloc_user(ctl_size);
+    if (!mblog_hdr)
+        return -ENOMEM;
+
+    mblog_hdr->version = MBLOG_MMAP_VERSION;
+    mblog_hdr->nr_rings = nr_cpu_ids;
+    mblog_hdr->ring_size = ring_size;
+    mblog_hdr->data_offset = ctl_size;
+    mblog_hdr->map_size = ctl_size + (u64)nr_cpu_ids * ring_size;
+
+    for_each_possible_cpu(cpu) {
+        r = per_cpu_ptr(&mblog_rings, cpu);
+        b = mblog_buf_alloc(ring_size);
+        if (!b) {
+            mblog_free_rings();
+            return -ENOMEM;
+        }
+        RCU_INIT_POINTER(r->buf, b);
+        r->ctl = &mblog_hdr->rings[cpu];
+        r->ctl->present = 1;
+        INIT_LIST_HEAD(&r->cold);
+        r->cold_bytes = 0;
+        r->sealed = 0;
+        r->seq = 0;
+        r->dropped = 0;
+    }
+    return 0;
+}
+
 
 // Module initialization
 static int __init mblog_init(void)
 {
     int ret;
 
-    // Allocate buffer memory
-    log_buffer = kmalloc(bufsize, GFP_KERNEL);
-    if (!log_buffer)
-        return -ENOMEM;
+    // Allocate one ring per possible CPU
+    ret = mblog_alloc_rings();
+    if (ret)
+        return ret;
 
-    log_len = 0;
+    // Writer accounting table, fixed size so writers never allocate
+    mblog_sources = kcalloc(MBLOG_NR_SOURCES, sizeof(*mblog_sources), GFP_KERNEL);
+    if (!mblog_sources) {
+        ret = -ENOMEM;
+        goto err_sources;
+    }
+    mblog_other[MBLOG_SRC_USER].type = MBLOG_SRC_USER;
+    mblog_other[MBLOG_SRC_KERNEL].type = MBLOG_SRC_KERNEL;
 
-    // Initialize semaphore (binary semaphore -> value 1)
-    sema_init(&lock, 1);
+    // Compressed history, before any writer can fill a segment
+    ret = mblog_cold_init();
+    if (ret)
+        goto err_cold;
 
     // Allocate character device number
     ret = alloc_chrdev_region(&dev_no, 0, 1, DEVICE_NAME);
     if (ret)
-        return ret;
+        goto err_region;
 
     // Register cdev structure
     cdev_init(&mblog_cdev, &mblog_fops);
@@ -203,27 +2529,51 @@ static int __init mblog_init(void)
         goto err_class;
     }
 
-    device_create(mblog_class, NULL, dev_no, NULL, DEVICE_NAME);
+    device_create_with_groups(mblog_class, NULL, dev_no, NULL, mblog_groups, DEVICE_NAME);
 
-    pr_info("mblog: loaded device created /dev/%s\n", DEVICE_NAME);
+    // A spill file that cannot be opened is reported but does not stop the driver
+    if (spill_path && *spill_path) {
+        mutex_lock(&mblog_spill_lock);
+        ret = mblog_spill_start(spill_path);
+        mutex_unlock(&mblog_spill_lock);
+        if (ret)
+            pr_warn("mblog: cannot spill to %s (%d)\n", spill_path, ret);
+    }
+
+    pr_info("mblog: loaded device created /dev/%s (%zu byte ring per CPU, %s mode)\n",
+            DEVICE_NAME, ring_size, overwrite ? "overwrite" : "stop");
+    if (mblog_cold)
+        pr_info("mblog: keeping %d KB of %s compressed history per CPU\n", cold_kb, cold_alg);
     return 0;
 
 err_class:
     cdev_del(&mblog_cdev);
 err_dev:
     unregister_chrdev_region(dev_no, 1);
-    kfree(log_buffer);
+err_region:
+    mblog_cold_exit();
+err_cold:
+    kfree(mblog_sources);
+err_sources:
+    mblog_free_rings();
     return ret;
 }
 
 // Cleanup when module unloaded
 static void __exit mblog_exit(void)
 {
-    device_destroy(mblog_class, dev_no);
+    device_destroy(mblog_class, dev_no);    // no more spill/path writes after this
+
+    mutex_lock(&mblog_spill_lock);
+    mblog_spill_stop();
+    mutex_unlock(&mblog_spill_lock);
+
     class_destroy(mblog_class);
     cdev_del(&mblog_cdev);
     unregister_chrdev_region(dev_no, 1);
-    kfree(log_buffer);
+    mblog_cold_exit();
+    kfree(mblog_sources);
+    mblog_free_rings();
 
     pr_info("mblog: unloaded\n");
 }
@@ -4,13 +4,11 @@
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <string.h>
+#include "mblog.h"  // IOCTL command definitions shared with the kernel module
+#include "mblog_batch.h"  // writev() batching helper
 
 #define DEVICE "/dev/mblog"  // Device file path
 
-// IOCTL command definitions (must match kernel module)
-#define MBLOG_CLEAR     _IO('m', 1)
-#define MBLOG_GET_SIZE  _IOR('m', 2, size_t)
-
 // Function to clear buffer using ioctl()
 void clear_buffer(int fd)
 {
@@ -48,6 +46,82 @@ void write_log(int fd)
         perror("[-] Write failed");
 }
 
+// Function to write several lines with a single writev() call
+void write_batch(int fd)
+{
+    struct mblog_batch b;
+    static char lines[MBLOG_BATCH_MAX][256];
+    int n, i;
+
+    printf("How many lines (1-%d): ", MBLOG_BATCH_MAX);
+    scanf("%d", &n);
+    if (n < 1 || n > MBLOG_BATCH_MAX) {
+        printf("[!] Invalid count\n");
+        return;
+    }
+    getchar(); // clear leftover newline in input buffer
+
+    mblog_batch_init(&b, fd);
+    for (i = 0; i < n; i++) {
+        printf("Line %d: ", i + 1);
+        if (!fgets(lines[i], sizeof(lines[i]), stdin))
+            break;
+        mblog_batch_add(&b, lines[i], strlen(lines[i]));
+    }
+
+    // One system call for the whole batch
+    if (mblog_batch_flush(&b) >= 0)
+        printf("[+] Batch of %d lines written!\n", i);
+    else
+        perror("[-] Batch write failed");
+}
+
+// Function to list registered consumers and how far behind they are
+void show_consumers(int fd)
+{
+    struct mblog_consumer_info info[32];
+    struct mblog_consumers req = { .count = 32, .entries = (__u64)(unsigned long)info };
+    unsigned int i;
+
+    if (ioctl(fd, MBLOG_GET_CONSUMERS, &req) < 0) {
+        perror("[-] Failed to get consumers");
+        return;
+    }
+    if (req.count == 0) {
+        printf("[*] No registered consumers\n");
+        return;
+    }
+
+    for (i = 0; i < req.count && i < 32; i++)
+        printf("[*] #%u %-16.16s pid %u: lag %llu bytes, %llu records read, %llu missed\n",
+               info[i].id, info[i].name, info[i].pid, (unsigned long long)info[i].lag,
+               (unsigned long long)info[i].records, (unsigned long long)info[i].missed);
+    printf("[*] Slowest: #%u (%llu bytes behind)\n", req.slowest_id,
+           (unsigned long long)req.max_lag);
+}
+
+// Function to show how many bytes each writer got logged, throttled or dropped
+void show_stats(int fd)
+{
+    struct mblog_source_stats src[64];
+    struct mblog_stats st = { .count = 64, .entries = (__u64)(unsigned long)src };
+    unsigned int i;
+
+    if (ioctl(fd, MBLOG_GET_STATS, &st) < 0) {
+        perror("[-] Failed to get stats");
+        return;
+    }
+
+    for (i = 0; i < st.count && i < 64; i++)
+        printf("[*] %-6s %-32.32s accepted %llu, throttled %llu, dropped %llu bytes\n",
+               src[i].type == MBLOG_SRC_USER ? "user" : "kernel", src[i].name,
+               (unsigned long long)src[i].accepted, (unsigned long long)src[i].throttled,
+               (unsigned long long)src[i].dropped);
+    printf("[*] Total: accepted %llu, throttled %llu, dropped %llu bytes\n",
+           (unsigned long long)st.accepted, (unsigned long long)st.throttled,
+           (unsigned long long)st.dropped);
+}
+
 // Function to read stored logs from kernel module
 void read_log(int fd)
 {
@@ -76,6 +150,74 @@ void read_log(int fd)
     free(buf);
 }
 
+// Function to read stored logs as structured records (header + payload)
+void read_records(int fd)
+{
+    int format = MBLOG_FMT_RECORD;
+    size_t size, off;
+    ssize_t r;
+
+    ioctl(fd, MBLOG_GET_SIZE, &size);  // Stored bytes, headers included
+    if (size == 0) {
+        printf("[!] Buffer is empty\n");
+        return;
+    }
+
+    char *buf = malloc(size);
+    if (!buf) {
+        perror("malloc");
+        return;
+    }
+
+    ioctl(fd, MBLOG_SET_FORMAT, &format);
+    lseek(fd, 0, SEEK_SET);
+    r = read(fd, buf, size);
+
+    printf("\n==== STORED RECORDS ====\n");
+    // Walk the records using the length in each header only
+    for (off = 0; r > 0 && off < (size_t)r; ) {
+        struct mblog_rec *rec = (struct mblog_rec *)(buf + off);
+
+        printf("[%llu.%09llu] cpu=%u pid=%u seq=%llu %s: %.*s",
+               (unsigned long long)(rec->ts / 1000000000ULL),
+               (unsigned long long)(rec->ts % 1000000000ULL),
+               rec->cpu, rec->pid, (unsigned long long)rec->seq,
+               rec->source == MBLOG_SRC_KERNEL ? "kernel" : "user",
+               (int)rec->len, (char *)(rec + 1));
+        off += MBLOG_REC_SIZE(rec->len);
+    }
+
+    format = MBLOG_FMT_TEXT;
+    ioctl(fd, MBLOG_SET_FORMAT, &format);
+    free(buf);
+}
+
+// Function to choose what the driver does when its buffer is full
+void set_mode(int fd)
+{
+    int mode;
+
+    printf("0 = stop (reject new logs), 1 = overwrite oldest logs: ");
+    scanf("%d", &mode);
+
+    if (ioctl(fd, MBLOG_SET_MODE, &mode) == 0)
+        printf("[+] Mode set to %s\n", mode ? "overwrite" : "stop");
+    else
+        perror("[-] Failed to set mode");
+}
+
+// Function to show how many records this reader lost to overwrite/clear
+void get_missed(int fd)
+{
+    struct mblog_seq_info info;
+
+    if (ioctl(fd, MBLOG_GET_MISSED, &info) == 0)
+        printf("[*] Records read: %llu, missed: %llu\n",
+               (unsigned long long)info.records, (unsigned long long)info.missed);
+    else
+        perror("[-] Failed to get missed count");
+}
+
 int main()
 {
     int choice;
@@ -96,7 +238,13 @@ int main()
         printf("2. Read log\n");
         printf("3. Get buffer size\n");
         printf("4. Clear buffer\n");
-        printf("5. Exit\n");
+        printf("5. Set full buffer mode\n");
+        printf("6. Show missed records\n");
+        printf("7. Read log as records\n");
+        printf("8. Write batch of lines\n");
+        printf("9. Show consumers\n");
+        printf("10. Show writer stats\n");
+        printf("11. Exit\n");
         printf("Enter choice: ");
         scanf("%d", &choice);
 
@@ -106,7 +254,13 @@ int main()
             case 2: read_log(fd); break;
             case 3: get_size(fd); break;
             case 4: clear_buffer(fd); break;
-            case 5:
+            case 5: set_mode(fd); break;
+            case 6: get_missed(fd); break;
+            case 7: read_records(fd); break;
+            case 8: write_batch(fd); break;
+            case 9: show_consumers(fd); break;
+            case 10: show_stats(fd); break;
+            case 11:
                 printf("Exiting...\n");
                 close(fd); // Close device before exiting
                 return 0;
@@ -4,66 +4,280 @@
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
-#include <linux/mutex.h>
-#include <linux/semaphore.h>
-#include <linux/ioctl.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include "parking.h"
 
 #define DEVICE_NAME "parking_dev"
 #define MAX_SLOTS 8
 
-#define PARK  _IOR('p', 1, int)
-#define LEAVE _IOW('p', 2, int)
-
 static dev_t devt;
 static struct class *c;
 static struct cdev parking_cdev;
 
 static int num_slots = MAX_SLOTS;
-static int *slots;                    /* 0 = free, 1 = occupied */
-static struct semaphore slots_sem;    /* available slots */
-static struct mutex slots_mutex;      /* protects slots[] */
+static unsigned long *slot_map;       /* bit set = occupied, changed with atomic bit ops only */
+static atomic_t slots_free;           /* slots nobody has reserved */
+static DECLARE_WAIT_QUEUE_HEAD(park_wait);  /* PARK, PARK_N and poll() wait here for free slots */
 static int major;
 
-static DEFINE_PER_CPU(int, pcpu_alloc_count);
+/*
+ * Statistics, one copy per CPU: PARK and LEAVE only bump the counters of
+ * the CPU they run on (no shared cache line, no lock, no printk) and
+ * sysfs adds the copies up when somebody reads them.
+ */
+struct park_cpu_stats {
+    u64 allocations;
+    u64 releases;
+    u64 waits;
+    u64 wait_ns;
+    u64 wait_interrupted;
+};
+
+static DEFINE_PER_CPU(struct park_cpu_stats, park_stats);
+
+/*
+ * Where this CPU starts looking for a free bit. Each CPU starts in its own
+ * part of the map and keeps going from its last slot, so allocators on
+ * different CPUs mostly touch different words of slot_map instead of all
+ * fighting over the first free bit.
+ */
+static DEFINE_PER_CPU(unsigned int, slot_hint);
 
 module_param(num_slots, int, 0444);
 MODULE_PARM_DESC(num_slots, "Number of parking slots");
 
-static long parking_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+/*
+ * Take a free slot. The caller has reserved one with slots_take(), so at
+ * least one bit is clear at any time: the search wraps around until it
+ * wins a test_and_set_bit() race for one.
+ */
+static int slot_alloc(void)
 {
-    int slot, i, user_slot, ret = 0;
+    unsigned int bit = this_cpu_read(slot_hint);
+
+    for (;;) {
+        bit = find_next_zero_bit(slot_map, num_slots, bit);
+        if (bit >= num_slots) {
+            /* nothing free after the hint: go on from the start of the map */
+            bit = 0;
+            cond_resched();
+            continue;
+        }
+        if (!test_and_set_bit(bit, slot_map))
+            break;
+        /* somebody else took it between the search and the set, keep going */
+    }
 
-    switch (cmd) {
-    case PARK:
-        if (down_interruptible(&slots_sem))
-            return -EINTR;
+    this_cpu_write(slot_hint, bit + 1 < num_slots ? bit + 1 : 0);
+    return bit;
+}
 
-        if (mutex_lock_interruptible(&slots_mutex)) {
-            up(&slots_sem);
-            return -EINTR;
-        }
+/* Free a slot, false if it was not occupied */
+static bool slot_free(unsigned int slot)
+{
+    if (!test_and_clear_bit(slot, slot_map))
+        return false;
+
+    /* its cache line is warm here: the next PARK on this CPU tries it first */
+    this_cpu_write(slot_hint, slot);
+    return true;
+}
 
-        slot = -1;
-        for (i = 0; i < num_slots; i++) {
-            if (slots[i] == 0) {
-                slots[i] = 1;
-                slot = i;
-                this_cpu_inc(pcpu_alloc_count);
-                break;
-            }
+/*
+ * Reserve n slots at once, or none if fewer are free. A semaphore would
+ * need n down() calls for this, and could hand out part of a batch.
+ */
+static bool slots_take(int n)
+{
+    int free = atomic_read(&slots_free);
+
+    do {
+        if (free < n)
+            return false;
+    } while (!atomic_try_cmpxchg(&slots_free, &free, free - n));
+    return true;
+}
+
+/*
+ * Wake as many single-slot waiters as slots came back, the way up() woke
+ * one waiter per unit. PARK_N waiters and poll() wait non-exclusively and
+ * are woken on every put: a woken PARK_N that still does not fit goes back
+ * to sleep, and must not eat a wakeup a PARK behind it could have used.
+ */
+static void slots_put(int n)
+{
+    atomic_add(n, &slots_free);
+    /* wq_has_sleeper() orders the add before the check, see its comment */
+    if (wq_has_sleeper(&park_wait))
+        wake_up_interruptible_nr(&park_wait, n);
+}
+
+/* Reserve n slots, waiting for them unless nonblock; 0, -EAGAIN or -EINTR */
+static int slots_wait(int n, bool nonblock)
+{
+    DEFINE_WAIT(wait);
+    bool slept = false;
+    u64 start = 0;
+    int ret = 0;
+
+    if (slots_take(n))
+        return 0;
+    if (nonblock)
+        return -EAGAIN;
+
+    /*
+     * wait_event_interruptible() open-coded so the stats know whether we
+     * really slept: a LEAVE between the first try and here is no wait.
+     */
+    for (;;) {
+        if (n == 1)
+            prepare_to_wait_exclusive(&park_wait, &wait, TASK_INTERRUPTIBLE);
+        else
+            prepare_to_wait(&park_wait, &wait, TASK_INTERRUPTIBLE);
+        if (slots_take(n))
+            break;
+        if (signal_pending(current)) {
+            ret = -EINTR;
+            break;
+        }
+        /* only a real sleep pays for the clock */
+        if (!slept) {
+            start = ktime_get_ns();
+            slept = true;
         }
+        schedule();
+    }
+    finish_wait(&park_wait, &wait);
 
-        mutex_unlock(&slots_mutex);
+    /*
+     * We may have been the one exclusive waiter a put woke: if we give up,
+     * or slots are still free after ours, hand the wakeup on.
+     */
+    if (atomic_read(&slots_free) > 0 && wq_has_sleeper(&park_wait))
+        wake_up_interruptible(&park_wait);
 
-        if (slot < 0) {
-            up(&slots_sem);
-            return -EFAULT;
+    if (ret) {
+        this_cpu_inc(park_stats.wait_interrupted);
+        return ret;
+    }
+    if (slept) {
+        this_cpu_inc(park_stats.waits);
+        this_cpu_add(park_stats.wait_ns, ktime_get_ns() - start);
+    }
+    return 0;
+}
+
+static int park_one(unsigned long arg, bool nonblock)
+{
+    int slot, ret;
+
+    ret = slots_wait(1, nonblock);
+    if (ret)
+        return ret;
+
+    slot = slot_alloc();
+
+    if (copy_to_user((int __user *)arg, &slot, sizeof(slot))) {
+        slot_free(slot);
+        slots_put(1);
+        return -EFAULT;
+    }
+    this_cpu_inc(park_stats.allocations);
+    return slot;
+}
+
+/* PARK_N and LEAVE_N */
+static long park_batch(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct park_batch __user *ubatch = (struct park_batch __user *)arg;
+    struct park_batch batch;
+    int *slots, i;
+    long ret = 0;
+
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    /* more than num_slots could never be parked at once */
+    if (batch.count < 1 || batch.count > PARK_BATCH_MAX || batch.count > num_slots)
+        return -EINVAL;
+
+    slots = kvmalloc_array(batch.count, sizeof(*slots), GFP_KERNEL);
+    if (!slots)
+        return -ENOMEM;
+    batch.done = 0;
+
+    if (cmd == PARK_N) {
+        ret = slots_wait(batch.count, file->f_flags & O_NONBLOCK);
+        if (ret)
+            goto out;
+
+        for (i = 0; i < batch.count; i++)
+            slots[i] = slot_alloc();
+
+        /*
+         * The caller owns the slots only once both slots[] and done reached
+         * it: if either copy fails they go back, or nobody would free them.
+         */
+        batch.done = batch.count;
+        if (copy_to_user(u64_to_user_ptr(batch.slots), slots, batch.count * sizeof(*slots)) ||
+            put_user(batch.done, &ubatch->done)) {
+            for (i = 0; i < batch.count; i++)
+                slot_free(slots[i]);
+            slots_put(batch.count);
+            ret = -EFAULT;
+            goto out_free;
+        }
+        this_cpu_add(park_stats.allocations, batch.count);
+        goto out_free;
+    } else {
+        if (copy_from_user(slots, u64_to_user_ptr(batch.slots), batch.count * sizeof(*slots))) {
+            ret = -EFAULT;
+            goto out;
         }
 
-        if (copy_to_user((int __user *)arg, &slot, sizeof(slot)))
-            return -EFAULT;
+        for (i = 0; i < batch.count; i++) {
+            if (slots[i] >= 0 && slots[i] < num_slots && slot_free(slots[i]))
+                batch.done++;
+            else
+                ret = -EINVAL;
+        }
+        /* one wakeup for the whole batch */
+        if (batch.done) {
+            this_cpu_add(park_stats.releases, batch.done);
+            slots_put(batch.done);
+        }
+    }
+
+out:
+    if (copy_to_user(&ubatch->done, &batch.done, sizeof(batch.done)))
+        ret = -EFAULT;
+out_free:
+    kvfree(slots);
+    return ret;
+}
+
+static long parking_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    int user_slot, ret = 0;
 
-        ret = slot;
+    switch (cmd) {
+    case PARK:
+        ret = park_one(arg, false);
+        break;
+
+    case TRY_PARK:
+        ret = park_one(arg, true);
         break;
 
     case LEAVE:
@@ -73,34 +287,31 @@ static long parking_ioctl(struct file *file, unsigned int cmd, unsigned long arg
         if (user_slot < 0 || user_slot >= num_slots)
             return -EINVAL;
 
-        if (mutex_lock_interruptible(&slots_mutex))
-            return -EINTR;
-
-        if (slots[user_slot] == 0) {
-            mutex_unlock(&slots_mutex);
+        if (!slot_free(user_slot))
             return -EINVAL;
-        }
-
-        slots[user_slot] = 0;
-        mutex_unlock(&slots_mutex);
-        up(&slots_sem);
-
-        {
-            int cpu;
-            for_each_possible_cpu(cpu)
-                pr_info("CPU %d allocated %d slots\n",
-                        cpu, per_cpu(pcpu_alloc_count, cpu));
-        }
+        this_cpu_inc(park_stats.releases);
+        slots_put(1);
 
         ret = 0;
         break;
 
+    case PARK_N:
+    case LEAVE_N:
+        return park_batch(file, cmd, arg);
+
     default:
         ret = -ENOTTY;
     }
     return ret;
 }
 
+/* Readable while a slot is free: a PARK or TRY_PARK would not wait now */
+static __poll_t parking_poll(struct file *file, poll_table *wait)
+{
+    poll_wait(file, &park_wait, wait);
+    return atomic_read(&slots_free) > 0 ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
 static int parking_open(struct inode *inode, struct file *file)
 {
     pr_info("parking_dev: open\n");
@@ -113,63 +324,158 @@ static int parking_release(struct inode *inode, struct file *file)
     return 0;
 }
 
+/*
+ * sysfs, under /sys/class/parking_class/park_dev/stats/:
+ *   allocations, releases, waits, wait_ns,
+ *   wait_interrupted                        one text value each
+ *   snapshot                                all of them as struct park_stats
+ * Every read sums the per-CPU copies. Counters keep moving meanwhile, so
+ * two fields of one snapshot can be a few operations apart.
+ */
+static void park_stats_sum(struct park_stats *st)
+{
+    const struct park_cpu_stats *ps;
+    int cpu;
+
+    memset(st, 0, sizeof(*st));
+    st->version = PARK_STATS_VERSION;
+    st->size = sizeof(*st);
+    st->num_slots = num_slots;
+    st->free_slots = max(atomic_read(&slots_free), 0);
+
+    for_each_possible_cpu(cpu) {
+        ps = per_cpu_ptr(&park_stats, cpu);
+        st->allocations += READ_ONCE(ps->allocations);
+        st->releases += READ_ONCE(ps->releases);
+        st->waits += READ_ONCE(ps->waits);
+        st->wait_ns += READ_ONCE(ps->wait_ns);
+        st->wait_interrupted += READ_ONCE(ps->wait_interrupted);
+    }
+}
+
+#define PARK_STAT_ATTR(name)                                                             \
+static ssize_t name##_show(struct device *dev, struct device_attribute *attr, char *buf) \
+{                                                                                        \
+    struct park_stats st;                                                                \
+                                                                                         \
+    park_stats_sum(&st);                                                                 \
+    return sysfs_emit(buf, "%llu\n", st.name);                                           \
+}                                                                                        \
+static DEVICE_ATTR_RO(name)
+
+PARK_STAT_ATTR(allocations);
+PARK_STAT_ATTR(releases);
+PARK_STAT_ATTR(waits);
+PARK_STAT_ATTR(wait_ns);
+PARK_STAT_ATTR(wait_interrupted);
+
+static ssize_t snapshot_read(struct file *file, struct kobject *kobj, struct bin_attribute *attr,
+                             char *buf, loff_t off, size_t count)
+{
+    struct park_stats st;
+
+    park_stats_sum(&st);
+    return memory_read_from_buffer(buf, count, &off, &st, sizeof(st));
+}
+static BIN_ATTR_RO(snapshot, sizeof(struct park_stats));
+
+static struct attribute *park_stats_attrs[] = {
+    &dev_attr_allocations.attr,
+    &dev_attr_releases.attr,
+    &dev_attr_waits.attr,
+    &dev_attr_wait_ns.attr,
+    &dev_attr_wait_interrupted.attr,
+    NULL,
+};
+
+static struct bin_attribute *park_stats_bin_attrs[] = {
+    &bin_attr_snapshot,
+    NULL,
+};
+
+static const struct attribute_group park_stats_group = {
+    .name = "stats",
+    .attrs = park_stats_attrs,
+    .bin_attrs = park_stats_bin_attrs,
+};
+
+static const struct attribute_group *park_groups[] = {
+    &park_stats_group,
+    NULL,
+};
+
 static const struct file_operations parking_fops = {
     .owner = THIS_MODULE,
     .unlocked_ioctl = parking_ioctl,
+    .poll = parking_poll,
     .open = parking_open,
     .release = parking_release,
 };
 
 static int __init parking_init(void)
 {
-    int ret, i;
+    struct device *dev;
+    int ret, cpu;
 
-    if (num_slots <= 0 || num_slots > 1024) {
+    if (num_slots <= 0) {
         pr_warn("Invalid num_slots %d, using default %d\n", num_slots, MAX_SLOTS);
         num_slots = MAX_SLOTS;
     }
 
+    /* all slot state first: the device is usable as soon as cdev_add() returns */
+    slot_map = bitmap_zalloc(num_slots, GFP_KERNEL);
+    if (!slot_map)
+        return -ENOMEM;
+    atomic_set(&slots_free, num_slots);
+
+    /* spread the CPUs' starting points evenly over the map */
+    for_each_possible_cpu(cpu)
+        per_cpu(slot_hint, cpu) = div_u64((u64)cpu * num_slots, nr_cpu_ids);
+
     ret = alloc_chrdev_region(&devt, 0, 1, DEVICE_NAME);
     if (ret)
-        return ret;
-
+        goto err_map;
     major = MAJOR(devt);
+
+    c = class_create(THIS_MODULE, "parking_class");
+    if (IS_ERR(c)) {
+        ret = PTR_ERR(c);
+        goto err_region;
+    }
+
     cdev_init(&parking_cdev, &parking_fops);
     parking_cdev.owner = THIS_MODULE;
-
     ret = cdev_add(&parking_cdev, devt, 1);
-    if (ret) {
-        unregister_chrdev_region(devt, 1);
-        return ret;
-    }
+    if (ret)
+        goto err_class;
 
-    slots = kzalloc(sizeof(int) * num_slots, GFP_KERNEL);
-    if (!slots) {
-        cdev_del(&parking_cdev);
-        unregister_chrdev_region(devt, 1);
-        return -ENOMEM;
+    dev = device_create_with_groups(c, NULL, devt, NULL, park_groups, "park_dev");
+    if (IS_ERR(dev)) {
+        ret = PTR_ERR(dev);
+        goto err_cdev;
     }
 
-    c = class_create(THIS_MODULE,"parking_class");
-    device_create(c, NULL, devt, NULL, "park_dev");
-
-    sema_init(&slots_sem, num_slots);
-    mutex_init(&slots_mutex);
-
-    for (i = 0; i < num_slots; i++)
-        slots[i] = 0;
-
     pr_info("parking_dev: loaded major=%d num_slots=%d\n", major, num_slots);
     return 0;
+
+err_cdev:
+    cdev_del(&parking_cdev);
+err_class:
+    class_destroy(c);
+err_region:
+    unregister_chrdev_region(devt, 1);
+err_map:
+    bitmap_free(slot_map);
+    return ret;
 }
 
 static void __exit parking_exit(void)
 {
     device_destroy(c, devt);
-    class_destroy(c);
-    kfree(slots);
     cdev_del(&parking_cdev);
+    class_destroy(c);
     unregister_chrdev_region(devt, 1);
+    bitmap_free(slot_map);
     pr_info("parking_dev: unloaded\n");
 }
 
@@ -0,0 +1,148 @@
+// park_bench.c
+/*
+ * PARK/LEAVE pairs per second on /dev/park_dev from N threads.
+ *
+ *   ./park_bench [threads] [seconds] [batch]
+ *
+ * Every thread opens the device and, for seconds (default 3), parks and
+ * leaves again as fast as it can: one slot with PARK/LEAVE, or with a
+ * batch above 1 that many slots per PARK_N/LEAVE_N call. Load the driver
+ * with at least threads * batch slots (insmod file.ko num_slots=65536),
+ * otherwise threads wait for each other and the run measures the wait,
+ * not the allocator. The driver's contention counters (sysfs snapshot)
+ * are printed for the run as well.
+ *
+ * gcc -O2 -pthread -o park_bench park_bench.c
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include "parking.h"
+
+#define DEV_PATH "/dev/park_dev"
+#define STATS_PATH "/sys/class/parking_class/park_dev/stats/snapshot"
+
+struct bench_thread {
+    pthread_t tid;
+    unsigned long pairs;        /* slots parked and left again */
+    unsigned long errors;
+};
+
+static int seconds = 3, batch = 1;
+static volatile int stop;
+static pthread_barrier_t barrier;
+
+/* Driver counters summed over all CPUs, 0 if they cannot be read */
+static int read_stats(struct park_stats *st)
+{
+    int fd = open(STATS_PATH, O_RDONLY);
+    ssize_t n;
+
+    if (fd < 0)
+        return 0;
+    n = read(fd, st, sizeof(*st));
+    close(fd);
+    return n == sizeof(*st) && st->version == PARK_STATS_VERSION;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *bench_thread_fn(void *arg)
+{
+    struct bench_thread *t = arg;
+    int fd = open(DEV_PATH, O_RDWR);
+    int *slots = calloc(batch, sizeof(*slots));
+    struct park_batch b = { .count = batch, .slots = (unsigned long)slots };
+
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", DEV_PATH, strerror(errno));
+        exit(1);
+    }
+
+    pthread_barrier_wait(&barrier);
+    while (!stop) {
+        if (batch == 1) {
+            if (ioctl(fd, PARK, &slots[0]) < 0 || ioctl(fd, LEAVE, &slots[0]) < 0) {
+                t->errors++;
+                continue;
+            }
+        } else {
+            if (ioctl(fd, PARK_N, &b) < 0 || ioctl(fd, LEAVE_N, &b) < 0) {
+                t->errors++;
+                continue;
+            }
+        }
+        t->pairs += batch;
+    }
+
+    free(slots);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_threads = argc > 1 ? atoi(argv[1]) : 1;
+    struct bench_thread *threads;
+    unsigned long pairs = 0, errors = 0;
+    struct park_stats before, after;
+    double start, elapsed;
+    int i, have_stats;
+
+    if (argc > 2)
+        seconds = atoi(argv[2]);
+    if (argc > 3)
+        batch = atoi(argv[3]);
+    if (nr_threads < 1 || seconds < 1 || batch < 1 || batch > PARK_BATCH_MAX) {
+        fprintf(stderr, "usage: %s [threads] [seconds] [batch 1-%d]\n", argv[0], PARK_BATCH_MAX);
+        return 1;
+    }
+
+    threads = calloc(nr_threads, sizeof(*threads));
+    pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+    for (i = 0; i < nr_threads; i++)
+        pthread_create(&threads[i].tid, NULL, bench_thread_fn, &threads[i]);
+
+    /* start everybody at once */
+    have_stats = read_stats(&before);
+    pthread_barrier_wait(&barrier);
+    start = now_sec();
+    sleep(seconds);
+    stop = 1;
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        pairs += threads[i].pairs;
+        errors += threads[i].errors;
+    }
+    elapsed = now_sec() - start;
+
+    printf("park_bench: %d threads, batch %d, %.2f s: %.0f pairs/s (%.0f per thread, %.0f ns per pair), %lu errors\n",
+           nr_threads, batch, elapsed, pairs / elapsed, pairs / elapsed / nr_threads,
+           pairs ? elapsed * 1e9 * nr_threads / pairs : 0, errors);
+    if (have_stats && read_stats(&after)) {
+        unsigned long long waits = after.waits - before.waits;
+
+        printf("park_bench: driver: %llu allocations, %llu releases, %llu waits (%.0f ns mean), %llu interrupted\n",
+               (unsigned long long)(after.allocations - before.allocations),
+               (unsigned long long)(after.releases - before.releases), waits,
+               waits ? (double)(after.wait_ns - before.wait_ns) / waits : 0,
+               (unsigned long long)(after.wait_interrupted - before.wait_interrupted));
+    }
+
+    pthread_barrier_destroy(&barrier);
+    free(threads);
+    return errors != 0;
+}
@@ -0,0 +1,54 @@
+// parking.h - ioctl commands of /dev/park_dev, shared by the driver and user space
+#ifndef PARKING_H
+#define PARKING_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define PARK     _IOR('p', 1, int)      /* wait for a free slot, its number is written to arg */
+#define LEAVE    _IOW('p', 2, int)      /* free the slot in arg */
+#define TRY_PARK _IOR('p', 3, int)      /* like PARK, but -EAGAIN instead of waiting */
+#define PARK_N   _IOWR('p', 4, struct park_batch)   /* count slots at once, see below */
+#define LEAVE_N  _IOWR('p', 5, struct park_batch)   /* free count slots */
+
+#define PARK_BATCH_MAX 4096     /* slots in one PARK_N / LEAVE_N */
+
+/*
+ * PARK_N gets all count slots or none: it waits until that many are free
+ * (or fails with -EAGAIN if the file was opened with O_NONBLOCK) and then
+ * writes their numbers to slots[]. LEAVE_N frees every valid slot in
+ * slots[] and fails with -EINVAL if some were not (done tells how many
+ * were freed).
+ *
+ * Waiters are not served in order: a LEAVE wakes one PARK per freed slot,
+ * so a large PARK_N can starve while single PARKs keep taking the slots
+ * it is waiting to see free together.
+ *
+ * poll() reports POLLIN while at least one slot is free, so an event loop
+ * can wait for capacity and then use TRY_PARK or PARK_N with O_NONBLOCK.
+ */
+struct park_batch {
+    __u32 count;            /* in: slots to park or leave, 1 to PARK_BATCH_MAX */
+    __u32 done;             /* out: slots parked or freed */
+    __u64 slots;            /* in: user pointer to int[count] */
+};
+
+/*
+ * /sys/class/parking_class/park_dev/stats/ holds one text file per counter
+ * and "snapshot": all of them summed over the CPUs, as one struct park_stats.
+ */
+#define PARK_STATS_VERSION 1
+
+struct park_stats {
+    __u32 version;          /* PARK_STATS_VERSION */
+    __u32 size;             /* sizeof(struct park_stats), fields may be added at the end */
+    __u32 num_slots;
+    __u32 free_slots;       /* not reserved right now */
+    __u64 allocations;      /* slots handed out by PARK, TRY_PARK and PARK_N */
+    __u64 releases;         /* slots freed by LEAVE and LEAVE_N */
+    __u64 waits;            /* PARK / PARK_N calls that slept and then got their slots */
+    __u64 wait_ns;          /* time spent in those sleeps */
+    __u64 wait_interrupted; /* PARK / PARK_N calls that gave up on a signal (-EINTR) */
+};
+
+#endif
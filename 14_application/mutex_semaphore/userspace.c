@@ -8,9 +8,9 @@
 #include <errno.h>
 #include <string.h>
 
+#include "parking.h"
+
 #define DEV_PATH "/dev/park_dev"
-#define PARK  _IOR('p', 1, int)
-#define LEAVE _IOW('p', 2, int)
 
 int main(void)
 {
@@ -21,7 +21,8 @@ int main(void)
     }
 
     while (1) {
-        printf("\nCommands:\n 1) park (allocate slot)\n 2) leave (free slot)\n 3) quit\nChoose: ");
+        printf("\nCommands:\n 1) park (allocate slot)\n 2) leave (free slot)\n 3) quit\n"
+               " 4) try park (fail instead of waiting)\n 5) park N slots at once\nChoose: ");
         int cmd;
         if (scanf("%d", &cmd) != 1) {
             while (getchar() != '\n'); /* flush */
@@ -52,6 +53,33 @@ int main(void)
             }
         } else if (cmd == 3) {
             break;
+        } else if (cmd == 4) {
+            int slot = -1;
+            int ret = ioctl(fd, TRY_PARK, &slot);
+            if (ret < 0) {
+                /* EAGAIN: all slots are taken right now */
+                printf("TRY_PARK failed: %s\n", strerror(errno));
+            } else {
+                printf("TRY_PARK succeeded: slot=%d\n", slot);
+            }
+        } else if (cmd == 5) {
+            printf("How many slots: ");
+            int n;
+            if (scanf("%d", &n) != 1 || n < 1 || n > PARK_BATCH_MAX) {
+                while (getchar() != '\n');
+                printf("need 1 to %d\n", PARK_BATCH_MAX);
+                continue;
+            }
+            int slots[PARK_BATCH_MAX];
+            struct park_batch b = { .count = n, .slots = (unsigned long)slots };
+            if (ioctl(fd, PARK_N, &b) < 0) {
+                printf("PARK_N ioctl failed: %s\n", strerror(errno));
+            } else {
+                printf("PARK_N succeeded:");
+                for (int i = 0; i < (int)b.done; i++)
+                    printf(" %d", slots[i]);
+                printf("\n");
+            }
         } else {
             printf("unknown command\n");
         }
@@ -6,26 +6,535 @@
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/uaccess.h>
-#include <linux/rwlock.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/atomic.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/smp.h>
+#include <linux/cpu.h>
+#include <linux/moduleparam.h>
 #include <linux/jiffies.h>
 #include <linux/random.h>
+#include "rwstats_kernel.h"
 
 MODULE_LICENSE("GPL");
 
 #define DEVICE_NAME "rwstats"
 #define CLASS_NAME  "rwstats_class"
 
-struct my_stats {
-    unsigned long packets;
-    unsigned long errors;
-    unsigned long last_update_jiffies;
+/*
+ * One registered stat. Counters and histograms keep one copy per CPU: a
+ * writer only touches the copy of the CPU it runs on, so updates from
+ * different cores never share a cache line and need no lock. Readers add
+ * all copies up on demand.
+ */
+struct rwstat {
+    struct list_head node;          /* on rwstats_list */
+    char name[RWSTATS_NAME_LEN];
+    u32 id;
+    int type;                       /* RWSTATS_COUNTER / GAUGE / HISTOGRAM */
+    union {
+        u64 __percpu *counter;
+        atomic64_t gauge;
+        struct rwstat_hist __percpu *hist;
+    };
 };
 
-static struct my_stats stats;
-static rwlock_t stats_lock;
+/* Per-CPU part of a histogram, merged into a struct rwstats_hist on read */
+struct rwstat_hist {
+    u64 count;
+    u64 sum;
+    u64 buckets[RWSTATS_HIST_BUCKETS];
+};
+
+/*
+ * The registry. rwstats_lock only protects the list (register, unregister
+ * and readers walking it), never the values, so updates stay lockless.
+ */
+static LIST_HEAD(rwstats_list);
+static DEFINE_MUTEX(rwstats_lock);
+static u32 rwstats_nr;              /* stats on the list */
+static u32 rwstats_nr_hist;         /* histograms among them */
+static u32 rwstats_next_id;
+static u64 rwstats_generation;      /* bumped on every register/unregister */
+
+/* Built-in stats, updated by the simulated packet path below */
+static struct rwstat *stat_packets;
+static struct rwstat *stat_errors;
+static struct rwstat *stat_last_update;
+static struct rwstat *stat_latency;         /* packet processing time, ns */
+static struct rwstat *stat_interarrival;    /* time between packets on one CPU, ns */
+static DEFINE_PER_CPU(u64, last_arrival_ns);
+
 static struct timer_list stats_timer;
 
+static int publish_ms = 10;
+module_param(publish_ms, int, 0444);
+MODULE_PARM_DESC(publish_ms, "Update period of the mmap()ed stats page in ms");
+
+/* The mmap()ed stats page, republished while at least one mapping exists */
+static struct rwstats_page *rwstats_pg;
+static atomic_t rwstats_maps;
+static void rwstats_publish(struct work_struct *work);
+static DECLARE_DELAYED_WORK(rwstats_publish_work, rwstats_publish);
+
+/* ---- stats registry ---- */
+
+struct rwstat *rwstat_register(const char *name, int type)
+{
+    struct rwstat *s, *it;
+    int ret = -ENOMEM;
+
+    if (!name || !name[0] || strlen(name) >= RWSTATS_NAME_LEN ||
+        type < RWSTATS_COUNTER || type > RWSTATS_HISTOGRAM)
+        return ERR_PTR(-EINVAL);
+
+    s = kzalloc(sizeof(*s), GFP_KERNEL);
+    if (!s)
+        return ERR_PTR(-ENOMEM);
+    strscpy(s->name, name, sizeof(s->name));
+    s->type = type;
+
+    if (type == RWSTATS_COUNTER) {
+        s->counter = alloc_percpu(u64);
+        if (!s->counter)
+            goto err_free;
+    } else if (type == RWSTATS_HISTOGRAM) {
+        s->hist = alloc_percpu(struct rwstat_hist);
+        if (!s->hist)
+            goto err_free;
+    } else {
+        atomic64_set(&s->gauge, 0);
+    }
+
+    mutex_lock(&rwstats_lock);
+    list_for_each_entry(it, &rwstats_list, node) {
+        if (!strcmp(it->name, name)) {
+            mutex_unlock(&rwstats_lock);
+            ret = -EEXIST;
+            goto err_free;
+        }
+    }
+    s->id = rwstats_next_id++;
+    list_add_tail(&s->node, &rwstats_list);
+    rwstats_nr++;
+    if (type == RWSTATS_HISTOGRAM)
+        rwstats_nr_hist++;
+    rwstats_generation++;
+    mutex_unlock(&rwstats_lock);
+
+    return s;
+
+err_free:
+    if (type == RWSTATS_COUNTER)
+        free_percpu(s->counter);
+    else if (type == RWSTATS_HISTOGRAM)
+        free_percpu(s->hist);
+    kfree(s);
+    return ERR_PTR(ret);
+}
+EXPORT_SYMBOL(rwstat_register);
+
+/* The caller must make sure no update of s is still running */
+void rwstat_unregister(struct rwstat *s)
+{
+    if (IS_ERR_OR_NULL(s))
+        return;
+
+    mutex_lock(&rwstats_lock);
+    list_del(&s->node);
+    rwstats_nr--;
+    if (s->type == RWSTATS_HISTOGRAM)
+        rwstats_nr_hist--;
+    rwstats_generation++;
+    mutex_unlock(&rwstats_lock);
+
+    if (s->type == RWSTATS_COUNTER)
+        free_percpu(s->counter);
+    else if (s->type == RWSTATS_HISTOGRAM)
+        free_percpu(s->hist);
+    kfree(s);
+}
+EXPORT_SYMBOL(rwstat_unregister);
+
+/*
+ * this_cpu_*() operations are safe against interrupts and preemption, so
+ * the update functions can be called from any context, including hard IRQ.
+ */
+void rwstat_add(struct rwstat *s, u64 n)
+{
+    this_cpu_add(*s->counter, n);
+}
+EXPORT_SYMBOL(rwstat_add);
+
+void rwstat_set(struct rwstat *s, s64 v)
+{
+    atomic64_set(&s->gauge, v);
+}
+EXPORT_SYMBOL(rwstat_set);
+
+/* Bucket of v, the inverse of rwstats_bucket_lower() */
+static unsigned int rwstat_bucket(u64 v)
+{
+    unsigned int shift;
+
+    if (v < (1ULL << RWSTATS_HIST_SUB_BITS))
+        return v;
+    if (v >= (1ULL << RWSTATS_HIST_MAX_BITS))
+        return RWSTATS_HIST_BUCKETS - 1;
+
+    /* v >> shift keeps the top SUB_BITS + 1 bits: 2^SUB_BITS ... 2^(SUB_BITS + 1) - 1 */
+    shift = ilog2(v) - RWSTATS_HIST_SUB_BITS;
+    return (shift << RWSTATS_HIST_SUB_BITS) + (v >> shift);
+}
+
+/* Three per-CPU adds, no lock and no atomic read-modify-write */
+void rwstat_record(struct rwstat *s, u64 v)
+{
+    this_cpu_inc(s->hist->count);
+    this_cpu_add(s->hist->sum, v);
+    this_cpu_inc(s->hist->buckets[rwstat_bucket(v)]);
+}
+EXPORT_SYMBOL(rwstat_record);
+
+/*
+ * Lockless read of one stat: sum the per-CPU copies. Every counter only
+ * grows, so the result is at least what was counted before the call
+ * started; updates that race with the walk may or may not be included.
+ */
+static s64 rwstat_value(struct rwstat *s)
+{
+    u64 sum = 0;
+    int cpu;
+
+    switch (s->type) {
+    case RWSTATS_COUNTER:
+        for_each_possible_cpu(cpu)
+            sum += READ_ONCE(*per_cpu_ptr(s->counter, cpu));
+        return sum;
+    case RWSTATS_GAUGE:
+        return atomic64_read(&s->gauge);
+    default:
+        for_each_possible_cpu(cpu)
+            sum += READ_ONCE(per_cpu_ptr(s->hist, cpu)->count);
+        return sum;
+    }
+}
+
+/* Merge the per-CPU copies of a histogram */
+static void rwstat_hist_read(struct rwstat *s, struct rwstats_hist *h)
+{
+    int cpu, b;
+
+    memset(h, 0, sizeof(*h));
+    for_each_possible_cpu(cpu) {
+        const struct rwstat_hist *p = per_cpu_ptr(s->hist, cpu);
+
+        h->count += READ_ONCE(p->count);
+        h->sum += READ_ONCE(p->sum);
+        for (b = 0; b < RWSTATS_HIST_BUCKETS; b++)
+            h->buckets[b] += READ_ONCE(p->buckets[b]);
+    }
+}
+
+/*
+ * Value at the per_mille percentile: the middle of the bucket holding the
+ * sample of that rank. Ranks come from the bucket total, not h->count: the
+ * two may differ a little when updates race with the merge.
+ */
+static u64 rwstats_hist_pct(const struct rwstats_hist *h, unsigned int per_mille)
+{
+    u64 total = 0, rank, seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < RWSTATS_HIST_BUCKETS; i++)
+        total += h->buckets[i];
+    if (!total)
+        return 0;
+
+    rank = div_u64(total * per_mille + 999, 1000);
+    for (i = 0; i < RWSTATS_HIST_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+    if (i == RWSTATS_HIST_BUCKETS - 1)
+        return rwstats_bucket_lower(i);
+    return rwstats_bucket_lower(i) + (rwstats_bucket_lower(i + 1) - rwstats_bucket_lower(i)) / 2;
+}
+
+/* ---- snapshots ---- */
+
+/* What a reset-on-read file saw of one histogram at its previous snapshot */
+struct rwstats_base {
+    struct list_head node;
+    u32 id;
+    struct rwstats_hist last;
+};
+
+/* Per open file: output format and the snapshot read() is serving */
+struct rwstats_file {
+    /*
+     * Serializes everything below between threads sharing the file:
+     * pread() does not take the f_pos lock, and the ioctls do not either.
+     * Taken before rwstats_lock.
+     */
+    struct mutex lock;
+    int format;
+    bool reset;                     /* RWSTATS_SET_RESET */
+    struct list_head bases;         /* struct rwstats_base, only with reset */
+    char *buf;
+    size_t len;
+};
+
+static void rwstats_free_bases(struct rwstats_file *rf)
+{
+    struct rwstats_base *b, *tmp;
+
+    list_for_each_entry_safe(b, tmp, &rf->bases, node) {
+        list_del(&b->node);
+        kfree(b);
+    }
+}
+
+/*
+ * Histogram s as file rf sees it: all samples, or with reset only those
+ * since rf's previous snapshot (the per-CPU data is never cleared, so a
+ * reset cannot lose updates that race with it). Adds the percentiles.
+ * Called with rwstats_lock held.
+ */
+static void rwstats_hist_snapshot(struct rwstat *s, struct rwstats_file *rf,
+                                  struct rwstats_hist *h)
+{
+    struct rwstats_base *b;
+    int i;
+
+    rwstat_hist_read(s, h);
+
+    if (rf->reset) {
+        list_for_each_entry(b, &rf->bases, node)
+            if (b->id == s->id)
+                goto found;
+
+        /* first snapshot of this histogram: everything so far is new */
+        b = kzalloc(sizeof(*b), GFP_KERNEL);
+        if (b) {
+            b->id = s->id;
+            list_add(&b->node, &rf->bases);
+        }
+found:
+        if (b) {
+            /* h becomes the difference, b->last the new totals */
+            swap(h->count, b->last.count);
+            h->count = b->last.count - h->count;
+            swap(h->sum, b->last.sum);
+            h->sum = b->last.sum - h->sum;
+            for (i = 0; i < RWSTATS_HIST_BUCKETS; i++) {
+                swap(h->buckets[i], b->last.buckets[i]);
+                h->buckets[i] = b->last.buckets[i] - h->buckets[i];
+            }
+        }
+    }
+
+    h->p50 = rwstats_hist_pct(h, 500);
+    h->p90 = rwstats_hist_pct(h, 900);
+    h->p99 = rwstats_hist_pct(h, 990);
+    h->p999 = rwstats_hist_pct(h, 999);
+}
+
+/* Binary table, see rwstats.h. Called with rwstats_lock held. */
+static char *rwstats_build_binary(struct rwstats_file *rf, size_t *len)
+{
+    struct rwstats_table_hdr *hdr;
+    struct rwstats_entry *e;
+    struct rwstats_hist *h;
+    struct rwstat *s;
+    size_t size;
+    char *buf;
+    u16 hist = 0;
+
+    size = sizeof(*hdr) + rwstats_nr * sizeof(*e) + rwstats_nr_hist * sizeof(*h);
+    buf = kvzalloc(size, GFP_KERNEL);
+    if (!buf)
+        return NULL;
+
+    hdr = (struct rwstats_table_hdr *)buf;
+    hdr->magic = RWSTATS_MAGIC;
+    hdr->version = RWSTATS_VERSION;
+    hdr->hdr_size = sizeof(*hdr);
+    hdr->size = size;
+    hdr->nr_stats = rwstats_nr;
+    hdr->entry_size = sizeof(*e);
+    hdr->nr_hist = rwstats_nr_hist;
+    hdr->hist_size = sizeof(*h);
+    hdr->generation = rwstats_generation;
+
+    e = (struct rwstats_entry *)(hdr + 1);
+    h = (struct rwstats_hist *)(e + rwstats_nr);
+    list_for_each_entry(s, &rwstats_list, node) {
+        memcpy(e->name, s->name, sizeof(e->name));
+        e->id = s->id;
+        e->type = s->type;
+        e->hist = RWSTATS_NO_HIST;
+        if (s->type == RWSTATS_HISTOGRAM) {
+            rwstats_hist_snapshot(s, rf, h);
+            e->value = h->count;
+            e->hist = hist++;
+            h++;
+        } else {
+            e->value = rwstat_value(s);
+        }
+        e++;
+    }
+
+    *len = size;
+    return buf;
+}
+
+/*
+ * Text view: "name: value" per stat, histograms print their count, sum and
+ * percentiles (the buckets are only in the binary table).
+ * Called with rwstats_lock held.
+ */
+static char *rwstats_build_text(struct rwstats_file *rf, size_t *len)
+{
+    struct rwstats_hist *h;
+    struct rwstat *s;
+    size_t size, n = 0;
+    char *buf;
+
+    size = rwstats_nr * (RWSTATS_NAME_LEN + 32) + rwstats_nr_hist * 200;
+    buf = kvmalloc(size + 1, GFP_KERNEL);
+    h = kmalloc(sizeof(*h), GFP_KERNEL);
+    if (!buf || !h) {
+        kvfree(buf);
+        kfree(h);
+        return NULL;
+    }
+
+    list_for_each_entry(s, &rwstats_list, node) {
+        if (s->type != RWSTATS_HISTOGRAM) {
+            n += scnprintf(buf + n, size + 1 - n, "%s: %lld\n", s->name, rwstat_value(s));
+            continue;
+        }
+
+        rwstats_hist_snapshot(s, rf, h);
+        n += scnprintf(buf + n, size + 1 - n,
+                       "%s: count=%llu sum=%llu p50=%llu p90=%llu p99=%llu p999=%llu\n",
+                       s->name, h->count, h->sum, h->p50, h->p90, h->p99, h->p999);
+    }
+
+    kfree(h);
+    *len = n;
+    return buf;
+}
+
+/*
+ * Copy every value into the mmap()ed page. Only this work item writes the
+ * page, so a bare sequence counter is enough: odd while the values change.
+ */
+static void rwstats_publish(struct work_struct *work)
+{
+    struct rwstats_page *pg = rwstats_pg;
+    u32 seq = pg->seq, i = 0;
+    struct rwstat *s;
+
+    mutex_lock(&rwstats_lock);
+    WRITE_ONCE(pg->seq, seq + 1);
+    smp_wmb();  /* seq odd before any value changes */
+
+    list_for_each_entry(s, &rwstats_list, node) {
+        if (i == pg->capacity)
+            break;
+        WRITE_ONCE(pg->values[i++], rwstat_value(s));
+    }
+    pg->nr_values = i;
+    pg->generation = rwstats_generation;
+    pg->ts_ns = ktime_get_ns();
+    pg->updates++;
+
+    smp_wmb();  /* values complete before seq is even again */
+    WRITE_ONCE(pg->seq, seq + 2);
+    mutex_unlock(&rwstats_lock);
+
+    if (atomic_read(&rwstats_maps))
+        schedule_delayed_work(&rwstats_publish_work, msecs_to_jiffies(publish_ms));
+}
+
+/* RWSTATS_GET_VALUES: every value in list order, no text and no table */
+static long rwstats_get_values(struct rwstats_values __user *uarg)
+{
+    struct rwstats_values v;
+    struct rwstat *s;
+    s64 *vals = NULL;
+    u32 n = 0;
+
+    if (copy_from_user(&v, uarg, sizeof(v)))
+        return -EFAULT;
+
+    /*
+     * Never allocate for more slots than there are stats: count comes from
+     * user space. One registered meanwhile is simply left out, the caller
+     * sees the real number in v.count.
+     */
+    v.count = min_t(u32, v.count, READ_ONCE(rwstats_nr));
+    if (v.values && v.count) {
+        vals = kvmalloc_array(v.count, sizeof(*vals), GFP_KERNEL);
+        if (!vals)
+            return -ENOMEM;
+    }
+
+    mutex_lock(&rwstats_lock);
+    if (vals) {
+        list_for_each_entry(s, &rwstats_list, node) {
+            if (n == v.count)
+                break;
+            vals[n++] = rwstat_value(s);
+        }
+    }
+    v.count = rwstats_nr;
+    v.generation = rwstats_generation;
+    mutex_unlock(&rwstats_lock);
+
+    v.version = RWSTATS_VERSION;
+    v.ts_ns = ktime_get_ns();
+
+    if ((n && copy_to_user(u64_to_user_ptr(v.values), vals, n * sizeof(*vals))) ||
+        copy_to_user(uarg, &v, sizeof(v))) {
+        kvfree(vals);
+        return -EFAULT;
+    }
+    kvfree(vals);
+    return 0;
+}
+
+/* Count live mappings (fork and split copy them), the page is updated while any exist */
+static void rwstats_vma_open(struct vm_area_struct *vma)
+{
+    atomic_inc(&rwstats_maps);
+}
+
+static void rwstats_vma_close(struct vm_area_struct *vma)
+{
+    atomic_dec(&rwstats_maps);
+}
+
+static const struct vm_operations_struct rwstats_vm_ops = {
+    .open  = rwstats_vma_open,
+    .close = rwstats_vma_close,
+};
+
 static dev_t devt;
 static struct cdev rw_cdev;
 static struct class *rw_class;
@@ -33,58 +542,332 @@ static struct device *rw_device;
 
 static unsigned int major_number = 0;
 
-/* ---- char device read ---- */
+/* ---- char device ---- */
 static ssize_t rwstats_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {
-    char kbuf[128];
-    int len;
-    unsigned long flags;
-    struct my_stats local;
+    struct rwstats_file *rf = file->private_data;
+    ssize_t ret;
+
+    mutex_lock(&rf->lock);
+
+    /* a read from offset 0 takes a new snapshot, later reads continue it */
+    if (*ppos == 0 || !rf->buf) {
+        char *snap;
+        size_t len;
+
+        mutex_lock(&rwstats_lock);
+        if (rf->format == RWSTATS_FMT_BINARY)
+            snap = rwstats_build_binary(rf, &len);
+        else
+            snap = rwstats_build_text(rf, &len);
+        mutex_unlock(&rwstats_lock);
+        if (!snap) {
+            mutex_unlock(&rf->lock);
+            return -ENOMEM;
+        }
+
+        kvfree(rf->buf);
+        rf->buf = snap;
+        rf->len = len;
+    }
+
+    ret = simple_read_from_buffer(buf, count, ppos, rf->buf, rf->len);
+    mutex_unlock(&rf->lock);
+    return ret;
+}
+
+static long rwstats_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct rwstats_file *rf = file->private_data;
+    int val;
 
-    /* take read lock (disable interrupts while reading) */
-    read_lock_irqsave(&stats_lock, flags);
-    local = stats; /* copy protected data */
-    read_unlock_irqrestore(&stats_lock, flags);
+    switch (cmd) {
+    case RWSTATS_SET_FORMAT:
+        if (copy_from_user(&val, (int __user *)arg, sizeof(val)))
+            return -EFAULT;
+        if (val != RWSTATS_FMT_TEXT && val != RWSTATS_FMT_BINARY)
+            return -EINVAL;
+        mutex_lock(&rf->lock);
+        rf->format = val;
+        /* the cached snapshot has the old format, the next read builds a new one */
+        kvfree(rf->buf);
+        rf->buf = NULL;
+        mutex_unlock(&rf->lock);
+        return 0;
+    case RWSTATS_SET_RESET:
+        if (copy_from_user(&val, (int __user *)arg, sizeof(val)))
+            return -EFAULT;
+        mutex_lock(&rf->lock);
+        mutex_lock(&rwstats_lock);
+        rf->reset = val != 0;
+        rwstats_free_bases(rf);
+        mutex_unlock(&rwstats_lock);
+        mutex_unlock(&rf->lock);
+        return 0;
+    case RWSTATS_GET_VALUES:
+        return rwstats_get_values((struct rwstats_values __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
 
-    len = snprintf(kbuf, sizeof(kbuf),
-                   "packets: %lu\nerrors: %lu\nlast_update_jiffies: %lu\n",
-                   local.packets, local.errors, local.last_update_jiffies);
+/* Map the stats page read-only, see struct rwstats_page */
+static int rwstats_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    int ret;
 
-    return simple_read_from_buffer(buf, count, ppos, kbuf, len);
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
+
+    ret = remap_vmalloc_range(vma, rwstats_pg, 0);
+    if (ret)
+        return ret;
+
+    vma->vm_ops = &rwstats_vm_ops;
+    rwstats_vma_open(vma);
+
+    /* start publishing now (no-op if the work is already queued) */
+    schedule_delayed_work(&rwstats_publish_work, 0);
+    return 0;
 }
 
 static int rwstats_open(struct inode *inode, struct file *file)
 {
+    struct rwstats_file *rf = kzalloc(sizeof(*rf), GFP_KERNEL);
+
+    if (!rf)
+        return -ENOMEM;
+    mutex_init(&rf->lock);
+    rf->format = RWSTATS_FMT_TEXT;
+    INIT_LIST_HEAD(&rf->bases);
+    file->private_data = rf;
+
     try_module_get(THIS_MODULE);
     return 0;
 }
 
 static int rwstats_release(struct inode *inode, struct file *file)
 {
+    struct rwstats_file *rf = file->private_data;
+
+    rwstats_free_bases(rf);
+    kvfree(rf->buf);
+    kfree(rf);
+
     module_put(THIS_MODULE);
     return 0;
 }
 
 static const struct file_operations rwstats_fops = {
-    .owner   = THIS_MODULE,
-    .read    = rwstats_read,
-    .open    = rwstats_open,
-    .release = rwstats_release,
+    .owner          = THIS_MODULE,
+    .read           = rwstats_read,
+    .llseek         = default_llseek,
+    .unlocked_ioctl = rwstats_ioctl,
+    .mmap           = rwstats_mmap,
+    .open           = rwstats_open,
+    .release        = rwstats_release,
+};
+
+/*
+ * Count one packet (and one error if error is true) on the current CPU.
+ * The last update gauge is shared by all CPUs, so it is only written when
+ * jiffies moved on: at most once per tick instead of once per packet.
+ * The time since the previous packet on this CPU and the time spent here
+ * go into the two histograms.
+ */
+static void rwstats_account(bool error)
+{
+    unsigned long now = jiffies;
+    u64 t0 = ktime_get_ns();
+    u64 prev = this_cpu_xchg(last_arrival_ns, t0);
+
+    rwstat_inc(stat_packets);
+    if (error)
+        rwstat_inc(stat_errors);
+    if (atomic64_read(&stat_last_update->gauge) != now)
+        rwstat_set(stat_last_update, now);
+
+    if (prev)
+        rwstat_record(stat_interarrival, t0 - prev);
+    rwstat_record(stat_latency, ktime_get_ns() - t0);
+}
+
+/* ---- update generator: hrtimer driven packets ---- */
+
+/*
+ * One hrtimer per CPU in per-CPU mode, only the one of the first online CPU
+ * otherwise. Every tick runs burst simulated packets through
+ * rwstats_account() on that CPU and records how late the tick fired.
+ * The timer runs in hard irq context, so a tick never works for more than
+ * half a period: the rest of the burst is dropped and the periods it
+ * would have eaten show up in gen_overruns.
+ */
+struct rwstats_gen {
+    struct hrtimer timer;
+    bool running;
+};
+static DEFINE_PER_CPU(struct rwstats_gen, rwstats_gen);
+static DEFINE_MUTEX(gen_lock);      /* serializes generator restarts */
+static bool gen_ready;              /* set once init is done */
+
+static int period_us = 1000000;
+static int burst = 1;
+static bool percpu_gen;
+
+#define GEN_MIN_PERIOD_US   10
+#define GEN_MAX_BURST       10000
+#define GEN_MAX_BURST_PER_US 10     /* packets per us of period we accept */
+
+static struct rwstat *stat_ticks;       /* generator ticks */
+static struct rwstat *stat_overruns;    /* periods the timer missed */
+static struct rwstat *stat_jitter;      /* tick expiry lateness, ns */
+static struct rwstat *stat_tick_rate;   /* achieved ticks/s, all CPUs */
+static struct rwstat *stat_update_rate; /* achieved packets/s, all CPUs */
+
+static enum hrtimer_restart rwstats_gen_fn(struct hrtimer *t)
+{
+    ktime_t now = ktime_get();
+    s64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(t)));
+    u64 period = (u64)READ_ONCE(period_us) * NSEC_PER_USEC;
+    ktime_t budget_end = ktime_add_ns(now, period / 2);
+    int i, n = READ_ONCE(burst);
+    u64 missed;
+
+    rwstat_record(stat_jitter, late > 0 ? late : 0);
+
+    /* random occasional error, as before */
+    for (i = 0; i < n; i++) {
+        rwstats_account((prandom_u32() % 10) == 0);
+        if ((i & 63) == 63 && ktime_after(ktime_get(), budget_end))
+            break;
+    }
+
+    rwstat_inc(stat_ticks);
+    /* from the time after the burst, so a slow tick skips periods instead of re-firing */
+    missed = hrtimer_forward(t, ktime_get(), ns_to_ktime(period));
+    if (missed > 1)
+        rwstat_add(stat_overruns, missed - 1);
+
+    return HRTIMER_RESTART;
+}
+
+/* Runs on the CPU whose timer it starts, pinned timers stay there */
+static void rwstats_gen_start_cpu(void *unused)
+{
+    struct rwstats_gen *g = this_cpu_ptr(&rwstats_gen);
+
+    g->running = true;
+    hrtimer_start(&g->timer, ns_to_ktime((u64)period_us * NSEC_PER_USEC),
+                  HRTIMER_MODE_REL_PINNED_HARD);
+}
+
+static void rwstats_gen_stop(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct rwstats_gen *g = per_cpu_ptr(&rwstats_gen, cpu);
+
+        if (g->running) {
+            hrtimer_cancel(&g->timer);
+            g->running = false;
+        }
+    }
+}
+
+/* Apply new parameters: stop every timer, start the ones of the new mode */
+static void rwstats_gen_restart(void)
+{
+    rwstats_gen_stop();
+
+    cpus_read_lock();
+    if (percpu_gen)
+        on_each_cpu(rwstats_gen_start_cpu, NULL, 1);
+    else
+        smp_call_function_single(cpumask_first(cpu_online_mask),
+                                 rwstats_gen_start_cpu, NULL, 1);
+    cpus_read_unlock();
+}
+
+/*
+ * The generator parameters can be changed at run time through
+ * /sys/module/<module>/parameters/, the timers restart with the new values.
+ */
+static int gen_param_set(const char *val, const struct kernel_param *kp)
+{
+    int v, ret;
+    bool b;
+
+    if (kp->arg == &percpu_gen) {
+        ret = kstrtobool(val, &b);
+        v = b;
+    } else {
+        ret = kstrtoint(val, 0, &v);
+    }
+    if (ret)
+        return ret;
+    if ((kp->arg == &period_us && v < GEN_MIN_PERIOD_US) ||
+        (kp->arg == &burst && (v < 1 || v > GEN_MAX_BURST)))
+        return -EINVAL;
+
+    mutex_lock(&gen_lock);
+    /* a burst that cannot fit in the period would only be cut short every tick */
+    if ((kp->arg == &period_us && burst > (s64)v * GEN_MAX_BURST_PER_US) ||
+        (kp->arg == &burst && v > (s64)period_us * GEN_MAX_BURST_PER_US)) {
+        mutex_unlock(&gen_lock);
+        return -EINVAL;
+    }
+    if (kp->arg == &percpu_gen)
+        percpu_gen = b;
+    else
+        *(int *)kp->arg = v;
+    if (gen_ready)
+        rwstats_gen_restart();
+    mutex_unlock(&gen_lock);
+    return 0;
+}
+
+static int gen_param_get(char *buf, const struct kernel_param *kp)
+{
+    if (kp->arg == &percpu_gen)
+        return param_get_bool(buf, kp);
+    return param_get_int(buf, kp);
+}
+
+static const struct kernel_param_ops gen_param_ops = {
+    .set = gen_param_set,
+    .get = gen_param_get,
 };
 
-/* ---- timer callback: simulate writer updating stats ---- */
+module_param_cb(period_us, &gen_param_ops, &period_us, 0644);
+MODULE_PARM_DESC(period_us, "Generator tick period in us (>= 10, >= burst / 10)");
+module_param_cb(burst, &gen_param_ops, &burst, 0644);
+MODULE_PARM_DESC(burst, "Simulated packets per tick (1-10000, <= 10 * period_us)");
+module_param_cb(percpu_gen, &gen_param_ops, &percpu_gen, 0644);
+MODULE_PARM_DESC(percpu_gen, "One generator timer per online CPU instead of one in total");
+
+/* ---- timer callback: achieved generator rate, once per second ---- */
 static void stats_timer_fn(struct timer_list *t)
 {
-    unsigned long flags;
+    static u64 last_ticks, last_packets, last_ns;
+    u64 ticks = rwstat_value(stat_ticks);
+    u64 packets = rwstat_value(stat_packets);
+    u64 now = ktime_get_ns();
 
-    /* exclusive write update (disable interrupts while updating) */
-    write_lock_irqsave(&stats_lock, flags);
-    stats.packets++;
-    /* random occasional error */
-    if ((prandom_u32() % 10) == 0)
-        stats.errors++;
-    stats.last_update_jiffies = jiffies;
-    write_unlock_irqrestore(&stats_lock, flags);
+    if (last_ns) {
+        u64 dt = now - last_ns;
+
+        rwstat_set(stat_tick_rate, div64_u64((ticks - last_ticks) * NSEC_PER_SEC, dt));
+        rwstat_set(stat_update_rate, div64_u64((packets - last_packets) * NSEC_PER_SEC, dt));
+    }
+    last_ticks = ticks;
+    last_packets = packets;
+    last_ns = now;
 
     /* re-arm timer (1s) */
     mod_timer(&stats_timer, jiffies + msecs_to_jiffies(1000));
@@ -93,22 +876,51 @@ static void stats_timer_fn(struct timer_list *t)
 /* ---- module init/exit ---- */
 static int __init rwstats_init(void)
 {
-    int ret;
+    int ret, cpu;
     struct device *dev;
 
     pr_info("rwstats: init\n");
 
-    /* init data & lock */
-    stats.packets = 0;
-    stats.errors = 0;
-    stats.last_update_jiffies = jiffies;
-    rwlock_init(&stats_lock);
+    /* built-in stats: "packets", "errors", "last_update_jiffies", two packet histograms and the generator's own */
+    stat_packets = rwstat_register("packets", RWSTATS_COUNTER);
+    stat_errors = rwstat_register("errors", RWSTATS_COUNTER);
+    stat_last_update = rwstat_register("last_update_jiffies", RWSTATS_GAUGE);
+    stat_latency = rwstat_register("packet_latency_ns", RWSTATS_HISTOGRAM);
+    stat_interarrival = rwstat_register("packet_interarrival_ns", RWSTATS_HISTOGRAM);
+    stat_ticks = rwstat_register("gen_ticks", RWSTATS_COUNTER);
+    stat_overruns = rwstat_register("gen_overruns", RWSTATS_COUNTER);
+    stat_jitter = rwstat_register("gen_jitter_ns", RWSTATS_HISTOGRAM);
+    stat_tick_rate = rwstat_register("gen_tick_rate_hz", RWSTATS_GAUGE);
+    stat_update_rate = rwstat_register("gen_update_rate", RWSTATS_GAUGE);
+    if (IS_ERR(stat_packets) || IS_ERR(stat_errors) || IS_ERR(stat_last_update) ||
+        IS_ERR(stat_latency) || IS_ERR(stat_interarrival) || IS_ERR(stat_ticks) ||
+        IS_ERR(stat_overruns) || IS_ERR(stat_jitter) || IS_ERR(stat_tick_rate) ||
+        IS_ERR(stat_update_rate)) {
+        pr_err("rwstats: cannot register the built-in stats\n");
+        ret = -ENOMEM;
+        goto err_stats;
+    }
+    rwstat_set(stat_last_update, jiffies);
+
+    /* stats page for mmap(), vmalloc_user() memory is zeroed and mappable */
+    if (publish_ms < 1)
+        publish_ms = 1;
+    rwstats_pg = vmalloc_user(PAGE_SIZE);
+    if (!rwstats_pg) {
+        ret = -ENOMEM;
+        goto err_stats;
+    }
+    rwstats_pg->magic = RWSTATS_MAGIC;
+    rwstats_pg->version = RWSTATS_VERSION;
+    rwstats_pg->hdr_size = sizeof(*rwstats_pg);
+    rwstats_pg->capacity = (PAGE_SIZE - sizeof(*rwstats_pg)) / sizeof(rwstats_pg->values[0]);
+    rwstats_pg->period_ms = publish_ms;
 
     /* allocate char device region */
     ret = alloc_chrdev_region(&devt, 0, 1, DEVICE_NAME);
     if (ret) {
         pr_err("rwstats: alloc_chrdev_region failed: %d\n", ret);
-        return ret;
+        goto err_stats;
     }
     major_number = MAJOR(devt);
 
@@ -119,7 +931,7 @@ static int __init rwstats_init(void)
     if (ret) {
         pr_err("rwstats: cdev_add failed: %d\n", ret);
         unregister_chrdev_region(devt, 1);
-        return ret;
+        goto err_stats;
     }
 
     rw_class = class_create(THIS_MODULE, CLASS_NAME);
@@ -127,7 +939,8 @@ static int __init rwstats_init(void)
         pr_err("rwstats: class_create failed\n");
         cdev_del(&rw_cdev);
         unregister_chrdev_region(devt, 1);
-        return PTR_ERR(rw_class);
+        ret = PTR_ERR(rw_class);
+        goto err_stats;
     }
 
     dev = device_create(rw_class, NULL, devt, NULL, DEVICE_NAME);
@@ -136,25 +949,69 @@ static int __init rwstats_init(void)
         class_destroy(rw_class);
         cdev_del(&rw_cdev);
         unregister_chrdev_region(devt, 1);
-        return PTR_ERR(dev);
+        ret = PTR_ERR(dev);
+        goto err_stats;
     }
 
-    /* setup timer */
+    /* setup timer (rate report) */
     timer_setup(&stats_timer, stats_timer_fn, 0);
     mod_timer(&stats_timer, jiffies + msecs_to_jiffies(1000));
 
+    /* start the update generator */
+    for_each_possible_cpu(cpu) {
+        struct hrtimer *t = &per_cpu_ptr(&rwstats_gen, cpu)->timer;
+
+        hrtimer_init(t, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_HARD);
+        t->function = rwstats_gen_fn;
+    }
+    mutex_lock(&gen_lock);
+    gen_ready = true;
+    rwstats_gen_restart();
+    mutex_unlock(&gen_lock);
+
     pr_info("rwstats: registered /dev/%s major=%u\n", DEVICE_NAME, major_number);
     return 0;
+
+err_stats:
+    vfree(rwstats_pg);
+    rwstat_unregister(stat_update_rate);
+    rwstat_unregister(stat_tick_rate);
+    rwstat_unregister(stat_jitter);
+    rwstat_unregister(stat_overruns);
+    rwstat_unregister(stat_ticks);
+    rwstat_unregister(stat_interarrival);
+    rwstat_unregister(stat_latency);
+    rwstat_unregister(stat_last_update);
+    rwstat_unregister(stat_errors);
+    rwstat_unregister(stat_packets);
+    return ret;
 }
 
 static void __exit rwstats_exit(void)
 {
+    mutex_lock(&gen_lock);
+    gen_ready = false;
+    rwstats_gen_stop();
+    mutex_unlock(&gen_lock);
     del_timer_sync(&stats_timer);
     device_destroy(rw_class, devt);
     class_destroy(rw_class);
     cdev_del(&rw_cdev);
     unregister_chrdev_region(devt, 1);
 
+    cancel_delayed_work_sync(&rwstats_publish_work);
+    vfree(rwstats_pg);
+    rwstat_unregister(stat_update_rate);
+    rwstat_unregister(stat_tick_rate);
+    rwstat_unregister(stat_jitter);
+    rwstat_unregister(stat_overruns);
+    rwstat_unregister(stat_ticks);
+    rwstat_unregister(stat_interarrival);
+    rwstat_unregister(stat_latency);
+    rwstat_unregister(stat_last_update);
+    rwstat_unregister(stat_errors);
+    rwstat_unregister(stat_packets);
+
     pr_info("rwstats: exit\n");
 }
 
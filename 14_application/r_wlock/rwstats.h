@@ -0,0 +1,142 @@
+/* rwstats.h - layout shared by the rwstats driver and its user space readers */
+#ifndef RWSTATS_H
+#define RWSTATS_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* ---- ioctl commands ---- */
+#define RWSTATS_SET_FORMAT  _IOW('r', 1, int)   /* RWSTATS_FMT_TEXT / RWSTATS_FMT_BINARY */
+#define RWSTATS_GET_VALUES  _IOWR('r', 2, struct rwstats_values)   /* all values, no text */
+#define RWSTATS_SET_RESET   _IOW('r', 3, int)   /* 1: histograms in read() restart every snapshot */
+
+/* What read() returns on one open file */
+#define RWSTATS_FMT_TEXT    0   /* "name: value" lines (default) */
+#define RWSTATS_FMT_BINARY  1   /* struct rwstats_table_hdr + entries + histograms */
+
+/*
+ * read() takes one snapshot of all registered stats when the file offset is
+ * 0 and returns it from there on; lseek(fd, 0, SEEK_SET) asks for a new one.
+ * RWSTATS_SET_FORMAT drops the current snapshot but leaves the offset
+ * alone: seek back to 0 (or use pread() at 0) to read the new format.
+ * After RWSTATS_SET_RESET(1) histograms in the snapshots of that file only
+ * count the samples recorded since its previous snapshot; other readers and
+ * the totals in RWSTATS_GET_VALUES and the mmap()ed page are not affected.
+ */
+
+/* Kinds of stats a module can register */
+#define RWSTATS_COUNTER     0   /* only grows, summed over per-CPU copies */
+#define RWSTATS_GAUGE       1   /* current value, set by the owner */
+#define RWSTATS_HISTOGRAM   2   /* distribution of recorded values */
+
+#define RWSTATS_NAME_LEN        48
+#define RWSTATS_NO_HIST         0xffff
+
+#define RWSTATS_MAGIC       0x52575354  /* "RWST" */
+#define RWSTATS_VERSION     2
+
+/*
+ * Histograms use log-linear (HDR style) buckets. Values below 2^SUB_BITS
+ * get one bucket each; above that every power of two range is split into
+ * 2^SUB_BITS equal buckets, so a bucket is at most 1/16 of its values wide
+ * and percentiles are off by less than 6.25%. Values of 2^MAX_BITS and more
+ * (18 minutes in ns) land in the last bucket.
+ */
+#define RWSTATS_HIST_SUB_BITS   4
+#define RWSTATS_HIST_MAX_BITS   40
+#define RWSTATS_HIST_BUCKETS    ((RWSTATS_HIST_MAX_BITS - RWSTATS_HIST_SUB_BITS + 1) << \
+                                 RWSTATS_HIST_SUB_BITS)
+
+/* Smallest value that lands in bucket i, bucket i holds [lower(i), lower(i + 1)) */
+static inline __u64 rwstats_bucket_lower(unsigned int i)
+{
+    unsigned int group = i >> RWSTATS_HIST_SUB_BITS;
+    __u64 sub = i & ((1u << RWSTATS_HIST_SUB_BITS) - 1);
+
+    if (!group)
+        return sub;
+    return ((1ULL << RWSTATS_HIST_SUB_BITS) + sub) << (group - 1);
+}
+
+/*
+ * Binary snapshot:
+ *
+ *   [ struct rwstats_table_hdr ][ nr_stats * entry_size ][ nr_hist * hist_size ]
+ *
+ * Readers step through the arrays with entry_size and hist_size, so fields
+ * added at the end of a struct in a later version do not break them.
+ */
+struct rwstats_table_hdr {
+    __u32 magic;            /* RWSTATS_MAGIC */
+    __u16 version;          /* RWSTATS_VERSION */
+    __u16 hdr_size;         /* sizeof(struct rwstats_table_hdr) */
+    __u32 size;             /* bytes in the whole snapshot */
+    __u32 nr_stats;
+    __u32 entry_size;       /* sizeof(struct rwstats_entry) */
+    __u32 nr_hist;
+    __u32 hist_size;        /* sizeof(struct rwstats_hist) */
+    __u32 pad;
+    __u64 generation;       /* changes whenever a stat is registered or removed */
+};
+
+struct rwstats_entry {
+    char name[RWSTATS_NAME_LEN];
+    __u32 id;               /* stays the same while the stat is registered */
+    __u16 type;             /* RWSTATS_COUNTER / GAUGE / HISTOGRAM */
+    __u16 hist;             /* index into the histogram array, or RWSTATS_NO_HIST */
+    __s64 value;            /* counter total, gauge value or number of samples */
+};
+
+struct rwstats_hist {
+    __u64 count;            /* samples recorded */
+    __u64 sum;              /* sum of all samples */
+    __u64 p50;              /* percentiles, computed by the driver from buckets */
+    __u64 p90;
+    __u64 p99;
+    __u64 p999;
+    __u64 buckets[RWSTATS_HIST_BUCKETS];    /* see rwstats_bucket_lower() */
+};
+
+/*
+ * Cheap sampling. Read the names once from the binary table, then only
+ * fetch values: slot i always belongs to entry i of a table with the same
+ * generation (a histogram slot holds its number of samples). When the
+ * generation changes, read the table again.
+ */
+
+/* RWSTATS_GET_VALUES: one syscall, fixed header plus a value array */
+struct rwstats_values {
+    __u32 version;          /* out: RWSTATS_VERSION */
+    __u32 count;            /* in: slots in values, out: stats registered */
+    __u64 generation;       /* out */
+    __u64 ts_ns;            /* out: CLOCK_MONOTONIC time of the snapshot */
+    __u64 values;           /* in: user pointer to __s64[count], may be 0 */
+};
+
+/*
+ * mmap() of /dev/rwstats (one page, read-only): the driver republishes
+ * every value every period_ms while the page is mapped, so sampling needs
+ * no syscall at all. seq is odd while an update is in progress:
+ *
+ *   do {
+ *       s = load_acquire(&pg->seq);
+ *       copy what you need from pg
+ *   } while ((s & 1) || load_acquire(&pg->seq) != s);
+ *
+ * (with a read barrier between the copy and the second load of seq)
+ */
+struct rwstats_page {
+    __u32 magic;            /* RWSTATS_MAGIC */
+    __u16 version;          /* RWSTATS_VERSION */
+    __u16 hdr_size;         /* offset of values[] */
+    __u32 seq;
+    __u32 capacity;         /* slots of values[] that fit in the page */
+    __u32 nr_values;        /* slots in use: stats registered, at most capacity */
+    __u32 period_ms;        /* time between two updates */
+    __u64 generation;
+    __u64 ts_ns;            /* CLOCK_MONOTONIC time the values were taken */
+    __u64 updates;          /* updates published so far */
+    __s64 values[];
+};
+
+#endif
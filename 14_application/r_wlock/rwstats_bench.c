@@ -0,0 +1,217 @@
+// rwstats_bench.c
+/*
+ * Update throughput of three ways to protect the rwstats counters:
+ *
+ *   rwlock  - one struct behind write_lock_irqsave() (the old rwstats design)
+ *   seqlock - one struct behind write_seqlock_irqsave(): readers never block
+ *             writers, but writers still serialize on one lock
+ *   percpu  - one struct per CPU updated with this_cpu_inc() (rwstats now)
+ *
+ * For each design the module runs 1, 2, 4 ... max_threads kthreads (up to
+ * 64), thread i bound to the (i % online CPUs)-th CPU, each updating the counters
+ * for duration_ms. The updates per second are printed with pr_info.
+ *
+ * insmod rwstats_bench.ko [max_threads=64] [duration_ms=500]
+ * insmod blocks for the 3 designs x 7 thread counts (about 10 s with the
+ * defaults) and every thread has exited by the time it returns. Read the
+ * table with dmesg, rmmod rwstats_bench before the next run.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/rwlock.h>
+#include <linux/seqlock.h>
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+MODULE_LICENSE("GPL");
+
+#define BENCH_MAX_THREADS 64
+
+static int max_threads = BENCH_MAX_THREADS;
+module_param(max_threads, int, 0444);
+MODULE_PARM_DESC(max_threads, "Largest number of updater threads (1-64)");
+
+static int duration_ms = 500;
+module_param(duration_ms, int, 0444);
+MODULE_PARM_DESC(duration_ms, "Length of every run in ms");
+
+/* same layout as struct my_stats in rwstats */
+struct bench_stats {
+    unsigned long packets;
+    unsigned long errors;
+    unsigned long last_update_jiffies;
+};
+
+static struct bench_stats rw_stats;
+static DEFINE_RWLOCK(rw_lock);
+
+static struct bench_stats seq_stats;
+static DEFINE_SEQLOCK(seq_lock);
+
+static DEFINE_PER_CPU(struct bench_stats, pcpu_stats);
+
+enum bench_design { BENCH_RWLOCK, BENCH_SEQLOCK, BENCH_PERCPU };
+static const char * const design_names[] = { "rwlock", "seqlock", "percpu" };
+
+struct bench_thread {
+    struct task_struct *task;
+    enum bench_design design;
+    u64 ops;
+};
+
+static struct bench_thread threads[BENCH_MAX_THREADS];
+static int online[NR_CPUS];             /* ids of the online CPUs */
+static int nr_online;
+static atomic_t nr_ready;               /* threads waiting for the start signal */
+static bool go;
+static unsigned long deadline;          /* jiffies at which the threads stop */
+
+/* ---- one update, as rwstats would do it for a packet ---- */
+static void bench_update(enum bench_design design, bool error)
+{
+    unsigned long flags;
+
+    switch (design) {
+    case BENCH_RWLOCK:
+        write_lock_irqsave(&rw_lock, flags);
+        rw_stats.packets++;
+        if (error)
+            rw_stats.errors++;
+        rw_stats.last_update_jiffies = jiffies;
+        write_unlock_irqrestore(&rw_lock, flags);
+        break;
+    case BENCH_SEQLOCK:
+        write_seqlock_irqsave(&seq_lock, flags);
+        seq_stats.packets++;
+        if (error)
+            seq_stats.errors++;
+        seq_stats.last_update_jiffies = jiffies;
+        write_sequnlock_irqrestore(&seq_lock, flags);
+        break;
+    case BENCH_PERCPU:
+        this_cpu_inc(pcpu_stats.packets);
+        if (error)
+            this_cpu_inc(pcpu_stats.errors);
+        this_cpu_write(pcpu_stats.last_update_jiffies, jiffies);
+        break;
+    }
+}
+
+static int bench_thread_fn(void *arg)
+{
+    struct bench_thread *t = arg;
+    u64 ops = 0;
+
+    /* wait until every thread of this run is up (others may share this CPU) */
+    atomic_inc(&nr_ready);
+    while (!READ_ONCE(go))
+        cond_resched();
+
+    while (time_before(jiffies, deadline)) {
+        bench_update(t->design, (ops & 15) == 0);
+        /* let other threads on an oversubscribed CPU run */
+        if ((++ops & 1023) == 0)
+            cond_resched();
+    }
+
+    t->ops = ops;
+
+    /* exit only through kthread_stop(), so none is left in module code after init */
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop()) {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+/* Run nthreads updaters with one design, return updates per second */
+static u64 bench_run(enum bench_design design, int nthreads)
+{
+    int i, started = 0;
+    u64 ops = 0, start, elapsed;
+
+    WRITE_ONCE(go, false);
+    atomic_set(&nr_ready, 0);
+
+    for (i = 0; i < nthreads; i++) {
+        threads[i].design = design;
+        threads[i].ops = 0;
+        threads[i].task = kthread_create(bench_thread_fn, &threads[i],
+                                         "rwstats_bench/%d", i);
+        if (IS_ERR(threads[i].task))
+            break;
+        /* thread i runs on the (i % nr_online)-th online CPU */
+        kthread_bind(threads[i].task, online[i % nr_online]);
+        wake_up_process(threads[i].task);
+        started++;
+    }
+
+    while (atomic_read(&nr_ready) < started)
+        cond_resched();
+
+    deadline = jiffies + msecs_to_jiffies(duration_ms);
+    start = ktime_get_ns();
+    WRITE_ONCE(go, true);
+
+    /* each kthread_stop() returns once that thread is past the deadline and gone */
+    for (i = 0; i < started; i++)
+        kthread_stop(threads[i].task);
+    elapsed = ktime_get_ns() - start;
+
+    for (i = 0; i < started; i++)
+        ops += threads[i].ops;
+
+    return div64_u64(ops * NSEC_PER_SEC, elapsed ?: 1);
+}
+
+static void bench_report(enum bench_design design, int nthreads)
+{
+    u64 rate = bench_run(design, nthreads);
+
+    pr_info("rwstats_bench: %-8s %8d %16llu %16llu\n",
+            design_names[design], nthreads, rate, div_u64(rate, nthreads));
+}
+
+static int __init rwstats_bench_init(void)
+{
+    enum bench_design d;
+    int cpu, n;
+
+    if (max_threads < 1 || max_threads > BENCH_MAX_THREADS || duration_ms <= 0)
+        return -EINVAL;
+
+    cpus_read_lock();
+    for_each_online_cpu(cpu)
+        online[nr_online++] = cpu;
+    cpus_read_unlock();
+
+    pr_info("rwstats_bench: %d online CPUs, %d ms per run\n", nr_online, duration_ms);
+    pr_info("rwstats_bench: %-8s %8s %16s %16s\n",
+            "design", "threads", "updates/s", "per thread");
+
+    for (d = BENCH_RWLOCK; d <= BENCH_PERCPU; d++) {
+        for (n = 1; n < max_threads; n *= 2)
+            bench_report(d, n);
+        bench_report(d, max_threads);
+    }
+
+    return 0;
+}
+
+static void __exit rwstats_bench_exit(void)
+{
+}
+
+module_init(rwstats_bench_init);
+module_exit(rwstats_bench_exit);
@@ -0,0 +1,64 @@
+// rwstats_client.c
+/*
+ * Example user of the rwstats registry: registers a counter, a gauge and
+ * a histogram and updates them from a timer every 100 ms. Load it after
+ * rwstats.ko and the three stats show up in every read of /dev/rwstats.
+ */
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/err.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
+#include <linux/random.h>
+#include "rwstats_kernel.h"
+
+MODULE_LICENSE("GPL");
+
+static struct rwstat *events;       /* counter: timer ticks */
+static struct rwstat *queue_depth;  /* gauge: simulated queue length */
+static struct rwstat *latency;      /* histogram: simulated latency in ns */
+static struct timer_list client_timer;
+
+static void client_timer_fn(struct timer_list *t)
+{
+    rwstat_inc(events);
+    rwstat_set(queue_depth, prandom_u32() % 128);
+    rwstat_record(latency, 1000 + prandom_u32() % 100000);
+
+    mod_timer(&client_timer, jiffies + msecs_to_jiffies(100));
+}
+
+static int __init rwstats_client_init(void)
+{
+    events = rwstat_register("client_events", RWSTATS_COUNTER);
+    queue_depth = rwstat_register("client_queue_depth", RWSTATS_GAUGE);
+    latency = rwstat_register("client_latency_ns", RWSTATS_HISTOGRAM);
+    if (IS_ERR(events) || IS_ERR(queue_depth) || IS_ERR(latency)) {
+        rwstat_unregister(latency);
+        rwstat_unregister(queue_depth);
+        rwstat_unregister(events);
+        return -ENOMEM;
+    }
+
+    timer_setup(&client_timer, client_timer_fn, 0);
+    mod_timer(&client_timer, jiffies + msecs_to_jiffies(100));
+
+    pr_info("rwstats_client: registered 3 stats\n");
+    return 0;
+}
+
+static void __exit rwstats_client_exit(void)
+{
+    /* no update may run once the stats are gone */
+    del_timer_sync(&client_timer);
+
+    rwstat_unregister(latency);
+    rwstat_unregister(queue_depth);
+    rwstat_unregister(events);
+
+    pr_info("rwstats_client: exit\n");
+}
+
+module_init(rwstats_client_init);
+module_exit(rwstats_client_exit);
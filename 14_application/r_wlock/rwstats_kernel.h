@@ -0,0 +1,33 @@
+/* rwstats_kernel.h - stats registry the rwstats driver exports to other modules */
+#ifndef RWSTATS_KERNEL_H
+#define RWSTATS_KERNEL_H
+
+#include <linux/types.h>
+#include "rwstats.h"
+
+struct rwstat;
+
+/*
+ * Register a stat named name (unique, shorter than RWSTATS_NAME_LEN) of
+ * type RWSTATS_COUNTER, RWSTATS_GAUGE or RWSTATS_HISTOGRAM. It shows up in
+ * every read of /dev/rwstats until rwstat_unregister(). Returns the handle
+ * or ERR_PTR(-EINVAL / -EEXIST / -ENOMEM). May sleep.
+ */
+struct rwstat *rwstat_register(const char *name, int type);
+void rwstat_unregister(struct rwstat *s);
+
+/*
+ * Updates: lockless, safe in any context (hard IRQ included).
+ * Counters and histograms are per-CPU, so updates from different CPUs
+ * never share a cache line. A gauge is one shared value.
+ */
+void rwstat_add(struct rwstat *s, u64 n);       /* counter */
+void rwstat_set(struct rwstat *s, s64 v);       /* gauge */
+void rwstat_record(struct rwstat *s, u64 v);    /* histogram */
+
+static inline void rwstat_inc(struct rwstat *s)
+{
+    rwstat_add(s, 1);
+}
+
+#endif
@@ -1,28 +1,266 @@
 // read_stats.c
+/*
+ * Print all stats of /dev/rwstats.
+ *   ./userapp            text view, formatted by the driver
+ *   ./userapp -b         binary snapshot, decoded here (what a monitoring agent would use)
+ *   ./userapp -s [sec]   sampler: how many full samples per second each access
+ *                        method achieves (text read, binary read, ioctl, mmap)
+ *   ./userapp -w [sec]   watch: text view every sec seconds, histograms reset on
+ *                        every read so their percentiles cover the last interval
+ */
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include "rwstats.h"
 
-int main(void)
+#define SAMPLE_BUF (1 << 20)    /* big enough for one whole snapshot */
+#define MAX_VALUES 4096
+
+/* Read the whole snapshot of one open file, returns its length or -1 */
+static ssize_t read_all(int fd, char **out)
+{
+    size_t cap = 4096, len = 0;
+    char *buf = malloc(cap), *bigger;
+    ssize_t n;
+
+    if (!buf)
+        return -1;
+    while ((n = read(fd, buf + len, cap - len)) > 0) {
+        len += n;
+        if (len == cap) {
+            bigger = realloc(buf, cap * 2);
+            if (!bigger) {
+                free(buf);
+                return -1;
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+    }
+    if (n < 0) {
+        free(buf);
+        return -1;
+    }
+    *out = buf;
+    return len;
+}
+
+static void print_binary(const char *buf, size_t len)
+{
+    const struct rwstats_table_hdr *hdr = (const void *)buf;
+    const char *entries, *hists;
+    unsigned int i;
+    int b;
+
+    if (len < sizeof(*hdr) || hdr->magic != RWSTATS_MAGIC ||
+        hdr->version != RWSTATS_VERSION || len < hdr->size) {
+        fprintf(stderr, "bad snapshot\n");
+        return;
+    }
+    entries = buf + hdr->hdr_size;
+    hists = entries + (size_t)hdr->nr_stats * hdr->entry_size;
+
+    printf("rwstats v%u: %u stats, generation %llu\n", hdr->version, hdr->nr_stats,
+           (unsigned long long)hdr->generation);
+    for (i = 0; i < hdr->nr_stats; i++) {
+        const struct rwstats_entry *e = (const void *)(entries + (size_t)i * hdr->entry_size);
+        const struct rwstats_hist *h;
+
+        if (e->hist == RWSTATS_NO_HIST) {
+            printf("%-32s %lld\n", e->name, (long long)e->value);
+            continue;
+        }
+
+        h = (const void *)(hists + (size_t)e->hist * hdr->hist_size);
+        printf("%-32s count=%llu mean=%llu p50=%llu p90=%llu p99=%llu p999=%llu\n", e->name,
+               (unsigned long long)h->count,
+               (unsigned long long)(h->count ? h->sum / h->count : 0),
+               (unsigned long long)h->p50, (unsigned long long)h->p90,
+               (unsigned long long)h->p99, (unsigned long long)h->p999);
+        for (b = 0; b < RWSTATS_HIST_BUCKETS; b++)
+            if (h->buckets[b])
+                printf("    >= %-14llu %llu\n", (unsigned long long)rwstats_bucket_lower(b),
+                       (unsigned long long)h->buckets[b]);
+    }
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char sample_buf[SAMPLE_BUF];
+static __s64 values[MAX_VALUES];
+
+/* One sample through read(): a pread() at offset 0 takes a new snapshot */
+static int sample_read(int fd)
+{
+    return pread(fd, sample_buf, sizeof(sample_buf), 0) > 0;
+}
+
+static int sample_ioctl(int fd)
+{
+    struct rwstats_values v = { .count = MAX_VALUES, .values = (__u64)(unsigned long)values };
+
+    return ioctl(fd, RWSTATS_GET_VALUES, &v) == 0;
+}
+
+/* One consistent copy of the published values, no syscall */
+static int sample_mmap(const struct rwstats_page *pg)
+{
+    __u32 seq, n;
+
+    do {
+        seq = __atomic_load_n(&pg->seq, __ATOMIC_ACQUIRE);
+        n = pg->nr_values < MAX_VALUES ? pg->nr_values : MAX_VALUES;
+        memcpy(values, pg->values, n * sizeof(values[0]));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || __atomic_load_n(&pg->seq, __ATOMIC_RELAXED) != seq);
+
+    return 1;
+}
+
+static void report(const char *method, unsigned long samples, double elapsed)
+{
+    printf("%-12s %14.0f %12.0f\n", method, samples / elapsed, elapsed * 1e9 / samples);
+}
+
+static const char *const methods[] = { "text read", "binary read", "ioctl", "mmap" };
+
+/* Sample as fast as possible with every method for seconds each */
+static int run_sampler(int seconds)
 {
+    int text_fd, bin_fd, format = RWSTATS_FMT_BINARY;
+    long page = sysconf(_SC_PAGESIZE);
+    const struct rwstats_page *pg;
+    unsigned long n;
+    double start, elapsed;
+    int m;
+
+    text_fd = open("/dev/rwstats", O_RDONLY);
+    bin_fd = open("/dev/rwstats", O_RDONLY);
+    if (text_fd < 0 || bin_fd < 0) {
+        perror("open /dev/rwstats");
+        return 1;
+    }
+    if (ioctl(bin_fd, RWSTATS_SET_FORMAT, &format) < 0) {
+        perror("RWSTATS_SET_FORMAT");
+        return 1;
+    }
+    pg = mmap(NULL, page, PROT_READ, MAP_SHARED, bin_fd, 0);
+    if (pg == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    printf("rwstats sampler: %d s per method, mmap page updated every %u ms\n",
+           seconds, pg->period_ms);
+    printf("%-12s %14s %12s\n", "method", "samples/s", "ns/sample");
+
+    for (m = 0; m < 4; m++) {
+        start = now_sec();
+        n = 0;
+        do {
+            /* check the clock only every 64 samples, it is not free either */
+            for (int i = 0; i < 64; i++) {
+                switch (m) {
+                case 0: n += sample_read(text_fd); break;
+                case 1: n += sample_read(bin_fd); break;
+                case 2: n += sample_ioctl(bin_fd); break;
+                case 3: n += sample_mmap(pg); break;
+                }
+            }
+            elapsed = now_sec() - start;
+        } while (elapsed < seconds);
+
+        report(methods[m], n, elapsed);
+    }
+
+    munmap((void *)pg, page);
+    close(bin_fd);
+    close(text_fd);
+    return 0;
+}
+
+/* Print the text view every interval seconds, histograms per interval */
+static int run_watch(int interval)
+{
+    int reset = 1;
+    ssize_t n;
+
     int fd = open("/dev/rwstats", O_RDONLY);
     if (fd < 0) {
         perror("open /dev/rwstats");
         return 1;
     }
+    if (ioctl(fd, RWSTATS_SET_RESET, &reset) < 0) {
+        perror("RWSTATS_SET_RESET");
+        close(fd);
+        return 1;
+    }
 
-    char buf[256];
-    ssize_t n = read(fd, buf, sizeof(buf)-1);
+    /* the first snapshot covers everything before the watch started */
+    for (;;) {
+        n = pread(fd, sample_buf, sizeof(sample_buf), 0);
+        if (n < 0) {
+            perror("read");
+            break;
+        }
+        fwrite(sample_buf, 1, n, stdout);
+        printf("\n");
+        fflush(stdout);
+        sleep(interval);
+    }
+
+    close(fd);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "-s"))
+        return run_sampler(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : 1);
+    if (argc > 1 && !strcmp(argv[1], "-w"))
+        return run_watch(argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : 1);
+
+    int binary = argc > 1 && !strcmp(argv[1], "-b");
+    int format = binary ? RWSTATS_FMT_BINARY : RWSTATS_FMT_TEXT;
+    char *buf;
+    ssize_t n;
+
+    int fd = open("/dev/rwstats", O_RDONLY);
+    if (fd < 0) {
+        perror("open /dev/rwstats");
+        return 1;
+    }
+
+    if (ioctl(fd, RWSTATS_SET_FORMAT, &format) < 0) {
+        perror("RWSTATS_SET_FORMAT");
+        close(fd);
+        return 1;
+    }
+
+    n = read_all(fd, &buf);
     if (n < 0) {
         perror("read");
         close(fd);
         return 1;
     }
-    buf[n] = '\0';
-    printf("%s", buf);
 
+    if (binary)
+        print_binary(buf, n);
+    else
+        fwrite(buf, 1, n, stdout);
+
+    free(buf);
     close(fd);
     return 0;
 }
-